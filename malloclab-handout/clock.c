@@ -1,6 +1,6 @@
 /* 
- * clock.c - Routines for using the cycle counters on x86, 
- *           Alpha, and Sparc boxes.
+ * clock.c - Routines for using the cycle counters on x86, x86-64,
+ *           AArch64, and Alpha boxes.
  * 
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/times.h>
 #include "clock.h"
 
@@ -71,6 +72,162 @@ double get_counter()
 }
 /* $end x86cyclecounter */
 
+/* Older counters are taken on trust and calibrated against the clock */
+static int counter_usable(void)
+{
+    return 1;
+}
+
+static double counter_hz(const char **source)
+{
+    return 0;
+}
+
+#elif defined(__x86_64__)
+/*******************************************************
+ * x86-64 versions of start_counter() and get_counter()
+ *******************************************************/
+#include <stdint.h>
+#include <cpuid.h>
+
+static uint64_t cyc_start = 0;
+static int use_rdtscp = -1;   /* -1 until probed */
+
+/*
+ * access_counter - Read the time-stamp counter. rdtscp waits for every
+ * earlier instruction to finish and the lfence after it keeps later
+ * ones from starting early, so the read brackets exactly the timed
+ * code. CPUs without rdtscp fence a plain rdtsc on both sides.
+ */
+static uint64_t access_counter(void)
+{
+    unsigned hi, lo, aux;
+
+    if (use_rdtscp < 0) {
+	unsigned a, b, c, d;
+	use_rdtscp = __get_cpuid(0x80000001, &a, &b, &c, &d) &&
+	    (d & (1u << 27));
+    }
+    if (use_rdtscp)
+	asm volatile("rdtscp; lfence" : "=a" (lo), "=d" (hi), "=c" (aux)
+		     : : "memory");
+    else
+	asm volatile("lfence; rdtsc; lfence" : "=a" (lo), "=d" (hi)
+		     : : "memory");
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+ * counter_usable - The TSC only measures time if it is invariant: it
+ * ticks at one rate through frequency changes and deep sleep states.
+ */
+static int counter_usable(void)
+{
+    unsigned a, b, c, d;
+
+    return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8));
+}
+
+/*
+ * counter_hz - Rate of the invariant TSC as the CPU reports it, or 0
+ * if it does not. Leaf 0x15 gives the crystal clock and TSC ratio;
+ * leaf 0x16 the base clock, which the TSC runs at when 0x15 leaves the
+ * crystal out; hypervisors that pass the TSC through report its rate
+ * in leaf 0x40000010.
+ */
+static double counter_hz(const char **source)
+{
+    unsigned a, b, c, d;
+    unsigned max = __get_cpuid_max(0, NULL);
+
+    if (max >= 0x15) {
+	__cpuid_count(0x15, 0, a, b, c, d);
+	if (a && b && c) {
+	    *source = "cpuid 0x15";
+	    return (double) c * b / a;
+	}
+    }
+    if (max >= 0x16) {
+	__cpuid_count(0x16, 0, a, b, c, d);
+	if (a & 0xffff) {
+	    *source = "cpuid 0x16";
+	    return (a & 0xffff) * 1e6;
+	}
+    }
+    /* The hypervisor leaves only exist when CPUID.1:ECX[31] says so */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1u << 31)))
+	return 0;
+    __cpuid(0x40000000, a, b, c, d);
+    if (a >= 0x40000010) {
+	__cpuid(0x40000010, a, b, c, d);
+	if (a) {
+	    *source = "hypervisor";
+	    return a * 1e3;
+	}
+    }
+    return 0;
+}
+
+/* Record the current value of the cycle counter. */
+void start_counter()
+{
+    cyc_start = access_counter();
+}
+
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
+{
+    return (double) (access_counter() - cyc_start);
+}
+
+#elif defined(__aarch64__)
+/*******************************************************
+ * AArch64 versions of start_counter() and get_counter()
+ *******************************************************/
+#include <stdint.h>
+
+static uint64_t cyc_start = 0;
+
+/*
+ * access_counter - Read the virtual count register. The isb keeps the
+ * read from being hoisted above the code being timed.
+ */
+static uint64_t access_counter(void)
+{
+    uint64_t val;
+
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r" (val) : : "memory");
+    return val;
+}
+
+/* The generic timer always ticks at a fixed rate */
+static int counter_usable(void)
+{
+    return 1;
+}
+
+/* counter_hz - Rate of the generic timer, which firmware sets in cntfrq */
+static double counter_hz(const char **source)
+{
+    uint64_t freq;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    *source = "cntfrq_el0";
+    return (double) freq;
+}
+
+/* Record the current value of the cycle counter. */
+void start_counter()
+{
+    cyc_start = access_counter();
+}
+
+/* Return the number of cycles since the last call to start_counter. */
+double get_counter()
+{
+    return (double) (access_counter() - cyc_start);
+}
+
 #elif defined(__alpha)
 
 /****************************************************
@@ -133,6 +290,17 @@ double get_counter()
     return result;
 }
 
+/* Older counters are taken on trust and calibrated against the clock */
+static int counter_usable(void)
+{
+    return 1;
+}
+
+static double counter_hz(const char **source)
+{
+    return 0;
+}
+
 #else
 
 /****************************************************************
@@ -158,6 +326,16 @@ double get_counter()
     printf("Please choose another timing package in config.h.\n");
     exit(1);
 }
+
+static int counter_usable(void)
+{
+    return 0;
+}
+
+static double counter_hz(const char **source)
+{
+    return 0;
+}
 #endif
 
 
@@ -201,6 +379,54 @@ double mhz(int verbose)
     return mhz_full(verbose, 2);
 }
 
+/*
+ * have_counter - Can the cycle counter on this machine time things?
+ */
+int have_counter(void)
+{
+    return counter_usable();
+}
+
+/* 
+ * calibrate_hz - Count the cycles that elapse over CAL_NSECS of the
+ * monotonic clock, busy waiting so that the CPU does not drop into a
+ * sleep state halfway through.
+ */
+#define CAL_NSECS 20000000L  /* 20 ms */
+
+static double calibrate_hz(void)
+{
+    struct timespec t0, t1;
+    long ns;
+    double cycles;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    start_counter();
+    do {
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+    } while (ns < CAL_NSECS);
+    cycles = get_counter();
+    return cycles * 1e9 / ns;
+}
+
+/*
+ * counter_mhz - Rate of the cycle counter in MHz. Invariant counters
+ * report their own rate; for the rest, a short calibration against the
+ * monotonic clock stands in for mhz()'s two second sleep.
+ */
+double counter_mhz(int verbose)
+{
+    const char *source = "calibrated";
+    double hz = counter_hz(&source);
+
+    if (hz == 0)
+	hz = calibrate_hz();
+    if (verbose)
+	printf("Cycle counter rate ~= %.1f MHz (%s)\n", hz / 1e6, source);
+    return hz / 1e6;
+}
+
 /** Special counters that compensate for timer interrupt overhead */
 
 static double cyc_per_tick = 0.0;
@@ -15,6 +15,12 @@ double mhz(int verbose);
 /* Determine clock rate of processor, having more control over accuracy */
 double mhz_full(int verbose, int sleeptime);
 
+/* Is there a cycle counter here that ticks at a constant rate? */
+int have_counter(void);
+
+/* Rate of the cycle counter, from the CPU or a short calibration */
+double counter_mhz(int verbose);
+
 /** Special counters that compensate for timer interrupt overhead */
 
 void start_comp_counter();
@@ -53,21 +53,36 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (8, or 16 on LP64 hosts to match the
+ * system malloc's guarantee for any object type)
  */
+#ifdef __LP64__
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8  
+#endif
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. memlib only reserves this much address
+ * space and commits pages as the heap grows, so it can be generous: on
+ * LP64 hosts it is as far as mm.c's 32-bit heap offsets reach. One replay
+ * of any trace fits in 20 MB; the driver's -T mode replays a trace on up
+ * to 16 threads against one heap.
  */
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#ifdef __LP64__
+#define MAX_HEAP ((size_t)1 << 32)  /* 4 GB */
+#else
+#define MAX_HEAP (16*20*(1<<20))    /* 320 MB */
+#endif
 
 /*****************************************************************************
- * Set exactly one of these USE_xxx constants to "1" to select a timing method
+ * Set exactly one of these USE_xxx constants to "1" to select the default
+ * timing method. The driver's -c option picks another at runtime, and the
+ * cycle counter gives way to gettimeofday where there is no steady one.
  *****************************************************************************/
-#define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
+#define USE_FCYC   1   /* cycle counter w/K-best scheme */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
 
 #define MM_IMPLICIT_THRESHOLD 0.46
 #define MM_EXPLICIT_THRESHOLD 0.85
@@ -2,16 +2,46 @@
  * High-level timing wrappers
  ****************************/
 #include <stdio.h>
+#include <string.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
 #include "config.h"
 
+/* Timing methods */
+#define TIMER_FCYC   0
+#define TIMER_ITIMER 1
+#define TIMER_GETTOD 2
+
 static double Mhz;  /* estimated CPU clock frequency */
 
+#if USE_FCYC
+static int timer = TIMER_FCYC;
+#elif USE_ITIMER
+static int timer = TIMER_ITIMER;
+#else
+static int timer = TIMER_GETTOD;
+#endif
+
 extern int verbose; /* -v option in mdriver.c */
 
+/*
+ * set_fsecs_timer - Pick the timing method before init_fsecs runs
+ */
+int set_fsecs_timer(const char *name)
+{
+    if (!strcmp(name, "fcyc"))
+	timer = TIMER_FCYC;
+    else if (!strcmp(name, "itimer"))
+	timer = TIMER_ITIMER;
+    else if (!strcmp(name, "gettod"))
+	timer = TIMER_GETTOD;
+    else
+	return -1;
+    return 0;
+}
+
 /*
  * init_fsecs - initialize the timing package
  */
@@ -19,24 +49,38 @@ void init_fsecs(void)
 {
     Mhz = 0; /* keep gcc -Wall happy */
 
-#if USE_FCYC
-    if (verbose)
-	printf("Measuring performance with a cycle counter.\n");
-
-    /* set key parameters for the fcyc package */
-    set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
-    set_fcyc_compensate(1);
-    set_fcyc_epsilon(0.01);
-    set_fcyc_k(3);
-    Mhz = mhz(verbose > 0);
-#elif USE_ITIMER
-    if (verbose)
-	printf("Measuring performance with the interval timer.\n");
-#elif USE_GETTOD
-    if (verbose)
-	printf("Measuring performance with gettimeofday().\n");
-#endif
+    if (timer == TIMER_FCYC && !have_counter()) {
+	if (verbose)
+	    printf("No constant rate cycle counter, ");
+	timer = TIMER_GETTOD;
+    }
+
+    switch (timer) {
+    case TIMER_FCYC:
+	if (verbose)
+	    printf("Measuring performance with a cycle counter.\n");
+
+	/* 
+	 * set key parameters for the fcyc package. The counter ticks at
+	 * a constant rate whatever the CPU is doing, so there is no timer
+	 * interrupt overhead to subtract.
+	 */
+	set_fcyc_maxsamples(20); 
+	set_fcyc_clear_cache(1);
+	set_fcyc_compensate(0);
+	set_fcyc_epsilon(0.01);
+	set_fcyc_k(3);
+	Mhz = counter_mhz(verbose > 0);
+	break;
+    case TIMER_ITIMER:
+	if (verbose)
+	    printf("Measuring performance with the interval timer.\n");
+	break;
+    default:
+	if (verbose)
+	    printf("Measuring performance with gettimeofday().\n");
+	break;
+    }
 }
 
 /*
@@ -44,14 +88,15 @@ void init_fsecs(void)
  */
 double fsecs(fsecs_test_funct f, void *argp) 
 {
-#if USE_FCYC
-    double cycles = fcyc(f, argp);
-    return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
-#endif 
+    switch (timer) {
+    case TIMER_FCYC: {
+	double cycles = fcyc(f, argp);
+	return cycles/(Mhz*1e6);
+    }
+    case TIMER_ITIMER:
+	return ftimer_itimer(f, argp, 10);
+    default:
+	return ftimer_gettod(f, argp, 10);
+    }
 }
 
-
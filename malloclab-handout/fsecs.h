@@ -2,3 +2,6 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+
+/* Select the timer by name (fcyc, itimer, gettod); -1 if unknown */
+int set_fsecs_timer(const char *name);
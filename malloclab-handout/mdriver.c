@@ -14,11 +14,21 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <limits.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
+#include "perfctr.h"
 #include "config.h"
 
 /**********************
@@ -31,7 +41,7 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -41,9 +51,17 @@
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* lower ranges in the splay tree, or next free record */
+    struct range_t *right; /* higher ranges in the splay tree */
 } range_t;
 
+/* Range records are carved from pools of RANGE_POOL_SIZE, not malloc'ed one by one */
+#define RANGE_POOL_SIZE 4096
+typedef struct range_pool_t {
+    struct range_pool_t *next;       /* next pool */
+    range_t ranges[RANGE_POOL_SIZE];
+} range_pool_t;
+
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
     enum {ALLOC, FREE, REALLOC} type; /* type of request */
@@ -62,6 +80,92 @@ typedef struct {
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* 
+ * Binary traces: this header, then num_ops packed records. A record is
+ * a type byte ('a', 'r' or 'f', as in a .rep file) and a 32-bit index,
+ * and then, except for a free, a 32-bit size; read_trace maps the file
+ * and widens the records into trace->ops. The fields are in the byte
+ * order of the writer, and a host with another order refuses the file.
+ */
+#define TRACE_MAGIC "MMTRACE"  /* 8 bytes with its NUL */
+#define TRACE_VERSION 2        /* of the record layout */
+#define TRACE_BYTE_ORDER 0x01020304
+typedef struct {
+    char magic[8];
+    int32_t sugg_heapsize;  /* as in a .rep file */
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t weight;
+    uint32_t version;       /* TRACE_VERSION of the writer */
+    uint32_t byte_order;    /* TRACE_BYTE_ORDER as the writer stored it */
+} trace_hdr_t;
+
+#define BINOP_FREE_SIZE 5   /* bytes in a free record */
+#define BINOP_SIZE      9   /* ... and in an alloc or realloc record */
+
+/* One thread's replay of a trace in the multithreaded mode (-T) */
+typedef struct {
+    pthread_t tid;   /* the replaying thread */
+    trace_t *trace;  /* the trace it replays */
+    char **blocks;   /* its own copy of trace->blocks */
+} replay_t;
+
+/* 
+ * The producer/consumer mode (-P): one thread replays a trace's mallocs
+ * and reallocs and hands each block the trace frees to a second thread
+ * through this single-producer, single-consumer ring, and the second
+ * thread frees it. A NULL entry tells the consumer the trace is done.
+ */
+#define HANDOFF_SLOTS 1024  /* power of 2 */
+typedef struct {
+    char *ring[HANDOFF_SLOTS];
+    unsigned int head;       /* next slot the consumer reads */
+    unsigned int tail;       /* next slot the producer writes */
+} handoff_t;
+
+/* 
+ * The streaming mode (-S): a trace is replayed without ever being held
+ * in memory. A reader thread decodes its ops into one of two buffers
+ * of STREAM_CHUNK ops while the replay works through the other, and
+ * the live blocks are kept in a hash table keyed by id, so memory
+ * stays bounded by the chunk size and the number of live blocks.
+ */
+#define STREAM_CHUNK 65536
+typedef struct {
+    FILE *file;                /* the trace, positioned after its header */
+    char *path;                /* ... and its name */
+    int binary;                /* is it a binary trace? */
+    int num_ids;               /* from its header */
+    int num_ops;
+    traceop_t *buf[2];         /* the two op buffers... */
+    int count[2];              /* ... how many ops each holds... */
+    int full[2];               /* ... and whether the reader has filled it */
+    int stop;                  /* set to make the reader give up early */
+    pthread_mutex_t lock;      /* protects count, full and stop */
+    pthread_cond_t cond;       /* signalled when any of them changes */
+    pthread_t tid;             /* the reader thread */
+} stream_t;
+
+/* One live block of a streamed trace */
+typedef struct {
+    int id;      /* block id, or -1 for an empty slot */
+    int size;    /* payload size */
+    char *p;     /* payload address */
+} blockent_t;
+
+/* The live blocks of a streamed trace: open addressing, linear probing */
+typedef struct {
+    blockent_t *slots;
+    unsigned int mask;   /* number of slots (a power of 2) minus 1 */
+    unsigned int count;  /* number of live blocks */
+} blocktab_t;
+
+/* What replay_stream checks or measures while it replays */
+#define STREAM_VALID 0  /* correctness, as eval_mm_valid */
+#define STREAM_UTIL  1  /* space utilization, as eval_mm_util */
+#define STREAM_SPEED 2  /* nothing, for timing, as eval_mm_speed */
+#define STREAM_RUNS  3  /* timed replays of a streamed trace; the fastest counts */
+
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -70,6 +174,9 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    int threads;       /* number of concurrent replays (eval_mm_threads only) */
+    replay_t *replays; /* ... and one replay_t for each of them */
+    handoff_t *handoff;/* the producer to consumer ring (eval_mm_handoff only) */
 } speed_t;
 
 /* Summarizes the important stats for some malloc function on some trace */
@@ -81,17 +188,66 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double peak_heap;  /* largest heap plus mappings during the trace (bytes) */
+    double final_heap; /* heap plus mappings once the trace is done (bytes) */
+    double events[PERFCTR_EVENTS]; /* hardware events over one run, -1 if not counted (-e) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * The parallel mode (-j): each trace is evaluated by a worker process
+ * of its own, forked from a driver that has already set up memlib, so
+ * every worker has its own copy of the heap and of mm.c's globals. A
+ * worker sends its results back down a pipe and exits.
+ */
+typedef struct {
+    pid_t pid;      /* the worker, or 0 if the slot is free */
+    int fd;         /* the read end of its pipe */
+    int tracenum;   /* the trace it evaluates */
+} job_t;
+
+/* 
+ * The latency mode (-L): each request in a trace is timed on its own
+ * with the cycle counter and counted in a log-linear histogram for its
+ * type, as HdrHistogram does. Values below HIST_SUB get a bucket each,
+ * and each power of two above that is split into HIST_SUB/2 buckets,
+ * so a bucket's values are all within 1/16 of each other.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB / 2)
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long n;    /* number of values counted */
+    uint64_t max;       /* largest value counted (cycles) */
+} hist_t;
+
+/* The latencies of one trace's requests, indexed by request type */
+typedef struct {
+    hist_t hist[3];
+} lat_t;
+
+/* What a worker sends back */
+typedef struct {
+    stats_t mm;     /* its trace's mm stats */
+    stats_t hp;     /* ... and huge-page stats (-H) */
+    int errors;     /* the errors it found */
+    int hugepages;  /* cleared if huge pages were not available */
+} jobresult_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int job_fd = -1; /* in a worker (-j), the write end of its pipe */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* The range record pools, and the records in them not in use */
+static range_pool_t *range_pools = NULL;
+static range_t *free_ranges = NULL;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -105,7 +261,8 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
+static range_t *splay_range(range_t *t, char *key);
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
@@ -113,6 +270,12 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *map_trace(int fd, char *path, trace_hdr_t *hdr);
+static void write_trace(char *tracedir, char *filename, trace_t *trace);
+static void check_trace_hdr(trace_hdr_t *hdr, char *path);
+static int decode_op(FILE *tracefile, char *path, traceop_t *op);
+static int unpack_op(unsigned char *rec, size_t len, int num_ids, traceop_t *op);
+static int read_binop(FILE *binfile, char *path, int num_ids, traceop_t *op);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -122,11 +285,52 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, stats_t *stats);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for timing concurrent replays of a trace against mm.c (-T) */
+static void eval_mm_threads(void *ptr);
+static void *replay_thread(void *vargp);
+
+/* Routines for timing each request of a trace (-L) */
+static void eval_mm_latency(trace_t *trace, lat_t *lat, double overhead);
+static void hist_add(hist_t *h, double cycles);
+static uint64_t hist_percentile(hist_t *h, double q);
+
+/* Routines for timing a trace whose frees run on another thread (-P) */
+static void eval_mm_handoff(void *ptr);
+static void *handoff_consumer(void *vargp);
+static void handoff_put(handoff_t *h, char *p);
+
+/* Routines for replaying a trace streamed from its file (-S) */
+static void eval_mm_streamed(char *tracedir, char *filename, int tracenum,
+			     range_t **ranges, stats_t *stats);
+static int replay_stream(char *path, int tracenum, int mode, range_t **ranges,
+			 blocktab_t *tab, stats_t *stats);
+static stream_t *stream_open(char *path);
+static void *stream_reader(void *vargp);
+static int stream_next(stream_t *s, int b);
+static void stream_release(stream_t *s, int b);
+static void stream_close(stream_t *s);
+static void blocktab_clear(blocktab_t *tab);
+static blockent_t *blocktab_find(blocktab_t *tab, int id);
+static blockent_t *blocktab_add(blocktab_t *tab, int id);
+static void blocktab_remove(blocktab_t *tab, blockent_t *e);
+
+/* Routines for evaluating traces in worker processes (-j) */
+static int job_start(job_t *jobs, int njobs, int tracenum,
+		     stats_t *mm_stats, stats_t *hp_stats, int *hugepages);
+static void job_exit(stats_t *mm_stats, stats_t *hp_stats, int hugepages);
+static int job_collect(job_t *jobs, int njobs,
+		       stats_t *mm_stats, stats_t *hp_stats, int *hugepages);
+
 /* Various helper routines */
-static void printresults(int n, stats_t *stats);
+static void parse_fit_policy(char *arg);
+static void printresults(int n, stats_t *stats, int heaps, int events);
+static void printevents(double *counts, double *ops);
+static void printcompare(int n, int scale, stats_t *base_stats, stats_t *stats,
+			 char *base_label, char *label);
+static void printlatency(int n, lat_t *lat, double mhz);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -145,11 +349,28 @@ int main(int argc, char **argv)
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *one_stats = NULL; /* one replay thread, for each trace (-T) */
+    stats_t *mt_stats = NULL;  /* concurrent replay threads, for each trace (-T) */
+    stats_t *pc_stats = NULL;  /* frees handed to a consumer thread, for each trace (-P) */
+    stats_t *hp_stats = NULL;  /* mm on a heap of huge pages, for each trace (-H) */
+    lat_t *lat = NULL;         /* request latencies, for each trace (-L) */
+    double overhead;           /* cycles it takes just to read the counter (-L) */
+    double mhz;                /* ... and the rate of the counter */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int threads = 0;     /* If set, also replay each trace on this many threads (-T) */
+    int handoff = 0;     /* If set, also time each trace with its frees on another thread (-P) */
+    int hugepages = 0;   /* If set, also time each trace on a heap of huge pages (-H) */
+    int convert = 0;     /* If set, write each trace in binary form and exit (-b) */
+    int stream = 0;      /* If set, stream each trace from its file instead of loading it (-S) */
+    int latency = 0;     /* If set, also time each request on its own (-L) */
+    int events = 0;      /* If set, count hardware events in one more run of each trace (-e) */
+    int njobs = 1;       /* Evaluate this many traces at once, each in its own process (-j) */
+    job_t *jobs = NULL;  /* ... and the worker running in each slot */
+    int j;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,8 +379,11 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:p:T:M:R:j:c:hvVgaelLPHbS")) != EOF) {
         switch (c) {
+	case 'b': /* Convert the traces to binary traces */
+	    convert = 1;
+	    break;
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
 	    break;
@@ -184,6 +408,51 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'p': /* Placement policy for mm.c */
+            parse_fit_policy(optarg);
+            break;
+        case 'T': /* Replay each trace concurrently on this many threads */
+            threads = atoi(optarg);
+            if (threads < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'j': /* Evaluate traces in this many worker processes at once */
+            njobs = atoi(optarg);
+            if (njobs < 1) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'c': /* Timer to measure throughput with */
+            if (set_fsecs_timer(optarg) < 0) {
+		printf("Unknown timer %s\n", optarg);
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'M': /* Smallest request mm.c gives a mapping of its own */
+            mm_set_mmap_threshold(strtoul(optarg, NULL, 0));
+            break;
+        case 'R': /* Most slack mm.c gives a block realloc grows again */
+            mm_set_realloc_headroom(strtoul(optarg, NULL, 0));
+            break;
+        case 'H': /* Time mm malloc on huge pages as well */
+            hugepages = 1;
+            break;
+        case 'e': /* Count hardware events in each trace */
+            events = 1;
+            break;
+        case 'L': /* Collect the latency of each request */
+            latency = 1;
+            break;
+        case 'S': /* Stream the traces rather than loading them */
+            stream = 1;
+            break;
+        case 'P': /* Free each trace's blocks on a second thread */
+            handoff = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -199,6 +468,18 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* Streaming only replays mm malloc, one trace at a time */
+    if (stream && (run_libc || threads || handoff || hugepages || latency || events)) {
+	printf("-S cannot be combined with -l, -T, -P, -H, -L or -e\n");
+	exit(1);
+    }
+
+    /* A request takes far less time than any other timer can resolve */
+    if (latency && !have_counter()) {
+	printf("-L needs a constant rate cycle counter\n");
+	exit(1);
+    }
+
     /* 
      * Check and print team info 
      */
@@ -235,6 +516,16 @@ int main(int argc, char **argv)
 	printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* Optionally convert the traces to binary traces and stop there */
+    if (convert) {
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    write_trace(tracedir, tracefiles[i], trace);
+	    free_trace(trace);
+	}
+	exit(0);
+    }
+
     /* Initialize the timing package */
     init_fsecs();
 
@@ -269,7 +560,7 @@ int main(int argc, char **argv)
 	/* Display the libc results in a compact table */
 	if (verbose) {
 	    printf("\nResults for libc malloc:\n");
-	    printresults(num_tracefiles, libc_stats);
+	    printresults(num_tracefiles, libc_stats, 0, 0);
 	}
     }
 
@@ -281,14 +572,30 @@ int main(int argc, char **argv)
 
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-    if (mm_stats == NULL)
+    hp_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+    if (mm_stats == NULL || hp_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
-    /* Initialize the simulated memory system in memlib.c */
+    /* Initialize the simulated memory system in memlib.c. With -H both
+       timings commit the heap in huge pages, so they differ only in the
+       pages that back it. */
     mem_init(); 
+    if (hugepages)
+	mem_set_commit_huge(1);
+    if (njobs > 1 && (jobs = (job_t *)calloc(njobs, sizeof(job_t))) == NULL)
+	unix_error("jobs calloc in main failed");
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
+	/* With -j only a worker goes on, and it stops after this trace */
+	if (njobs > 1 && job_start(jobs, njobs, i, mm_stats, hp_stats, &hugepages))
+	    continue;
+	if (stream) {
+	    eval_mm_streamed(tracedir, tracefiles[i], i, &ranges, &mm_stats[i]);
+	    if (njobs > 1)
+		job_exit(&mm_stats[i], &hp_stats[i], hugepages);
+	    continue;
+	}
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
@@ -297,21 +604,209 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i]);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (events)
+		perfctr_count(eval_mm_speed, &speed_params, mm_stats[i].events);
+
+	    /* Time it again with the heap emptied and moved to huge pages */
+	    if (hugepages) {
+		mem_reset_brk();
+		if (mem_set_hugepages(1) < 0) {
+		    printf("Huge pages are not available: %s\n", strerror(errno));
+		    hugepages = 0;
+		}
+		else {
+		    if (verbose > 1)
+			printf("Timing on huge pages.\n");
+		    hp_stats[i] = mm_stats[i];
+		    hp_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+		    mem_reset_brk();
+		    mem_set_hugepages(0);
+		}
+	    }
 	}
 	free_trace(trace);
+	if (njobs > 1)
+	    job_exit(&mm_stats[i], &hp_stats[i], hugepages);
+    }
+    while (njobs > 1 && job_collect(jobs, njobs, mm_stats, hp_stats, &hugepages))
+	;
+    free(jobs);
+
+    /* Leave the event columns out if no event was counted anywhere */
+    if (events) {
+	events = 0;
+	for (i = 0; i < num_tracefiles; i++)
+	    for (j = 0; j < PERFCTR_EVENTS; j++)
+		if (mm_stats[i].events[j] >= 0)
+		    events = 1;
+	if (!events)
+	    printf("No hardware event counters are available (perf_event_open).\n");
     }
 
     /* Display the mm results in a compact table */
-    if (verbose) {
+    if (verbose || events) {
 	printf("\nResults for mm malloc:\n");
-	printresults(num_tracefiles, mm_stats);
+	printresults(num_tracefiles, mm_stats, 1, events);
+	printf("\n");
+    }
+
+    /* Display how huge pages change the mm throughput */
+    if (hugepages) {
+	printf("\nResults for mm malloc on huge pages:\n");
+	printcompare(num_tracefiles, 1, mm_stats, hp_stats, "4K pages", "huge pgs");
+	printf("\n");
+    }
+    free(hp_stats);
+
+    /*
+     * Optionally time each trace replayed by one thread and then by
+     * several threads at once, sharing one mm heap
+     */
+    if (threads) {
+	one_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	mt_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (one_stats == NULL || mt_stats == NULL)
+	    unix_error("thread stats calloc in main failed");
+	if ((speed_params.replays = calloc(threads, sizeof(replay_t))) == NULL)
+	    unix_error("replays calloc in main failed");
+
+	/* 
+	 * Only these runs use the thread-safe allocator, one arena per
+	 * thread; the scored runs above were made without it
+	 */
+	mm_set_thread_safe(1);
+	mm_set_arenas(threads);
+
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (verbose > 1)
+		printf("Replaying %s on 1 and %d threads.\n", tracefiles[i], threads);
+	    for (j = 0; j < threads; j++) {
+		speed_params.replays[j].trace = trace;
+		speed_params.replays[j].blocks = calloc(trace->num_ids, sizeof(char *));
+		if (speed_params.replays[j].blocks == NULL)
+		    unix_error("replay blocks calloc in main failed");
+	    }
+	    speed_params.trace = trace;
+
+	    speed_params.threads = 1;
+	    one_stats[i].valid = 1;
+	    one_stats[i].ops = trace->num_ops;
+	    one_stats[i].secs = fsecs(eval_mm_threads, &speed_params);
+
+	    speed_params.threads = threads;
+	    mt_stats[i].valid = 1;
+	    mt_stats[i].ops = (double)trace->num_ops * threads;
+	    mt_stats[i].secs = fsecs(eval_mm_threads, &speed_params);
+
+	    for (j = 0; j < threads; j++)
+		free(speed_params.replays[j].blocks);
+	    free_trace(trace);
+	}
+	free(speed_params.replays);
+
+	printf("\nResults for mm malloc on %d threads:\n", threads);
+	printcompare(num_tracefiles, threads, one_stats, mt_stats, "1 thr", "all thr");
+	printf("\n");
+	free(one_stats);
+	free(mt_stats);
+	mm_set_thread_safe(0);
+	mm_set_arenas(1);
+    }
+
+    /*
+     * Optionally time each trace with its mallocs on one thread and
+     * its frees on another, against the same trace replayed by one thread
+     */
+    if (handoff) {
+	one_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	pc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (one_stats == NULL || pc_stats == NULL)
+	    unix_error("handoff stats calloc in main failed");
+	if ((speed_params.replays = calloc(1, sizeof(replay_t))) == NULL ||
+	    (speed_params.handoff = malloc(sizeof(handoff_t))) == NULL)
+	    unix_error("handoff calloc in main failed");
+
+	/* As for -T, with an arena for each of the two threads */
+	mm_set_thread_safe(1);
+	mm_set_arenas(2);
+
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (verbose > 1)
+		printf("Replaying %s with frees on a second thread.\n", tracefiles[i]);
+	    speed_params.replays[0].trace = trace;
+	    speed_params.replays[0].blocks = calloc(trace->num_ids, sizeof(char *));
+	    if (speed_params.replays[0].blocks == NULL)
+		unix_error("replay blocks calloc in main failed");
+	    speed_params.trace = trace;
+
+	    speed_params.threads = 1;
+	    one_stats[i].valid = 1;
+	    one_stats[i].ops = trace->num_ops;
+	    one_stats[i].secs = fsecs(eval_mm_threads, &speed_params);
+
+	    pc_stats[i].valid = 1;
+	    pc_stats[i].ops = trace->num_ops;
+	    pc_stats[i].secs = fsecs(eval_mm_handoff, &speed_params);
+
+	    free(speed_params.replays[0].blocks);
+	    free_trace(trace);
+	}
+	free(speed_params.replays);
+	free(speed_params.handoff);
+
+	printf("\nResults for mm malloc with frees on a second thread:\n");
+	printcompare(num_tracefiles, 1, one_stats, pc_stats, "1 thr", "handoff");
 	printf("\n");
+	free(one_stats);
+	free(pc_stats);
+	mm_set_thread_safe(0);
+	mm_set_arenas(1);
+    }
+
+    /*
+     * Optionally time each request of each trace on its own, less the
+     * cost of reading the counter, and report the tail of each type
+     */
+    if (latency) {
+	if ((lat = (lat_t *)calloc(num_tracefiles, sizeof(lat_t))) == NULL)
+	    unix_error("lat calloc in main failed");
+
+	/* Take the cheapest of many counter reads, as ovhd() does */
+	overhead = DBL_MAX;
+	for (i = 0; i < 1000; i++) {
+	    double o = ovhd();
+	    if (o < overhead)
+		overhead = o;
+	}
+
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (verbose > 1)
+		printf("Timing each request of %s.\n", tracefiles[i]);
+	    eval_mm_latency(trace, &lat[i], overhead);
+	    free_trace(trace);
+	}
+
+	mhz = counter_mhz(verbose > 1);
+	printf("\nRequest latencies for mm malloc (ns, less %.0f cycles of overhead):\n",
+	       overhead);
+	printlatency(num_tracefiles, lat, mhz);
+	printf("\n");
+	free(lat);
     }
 
     /* 
@@ -331,9 +826,14 @@ int main(int argc, char **argv)
     avg_mm_util = util/num_tracefiles;
 
     /* 
-     * Compute and print the performance index 
+     * Compute and print the performance index. A streamed replay also
+     * looks up every block id in a hash table while it is timed, so its
+     * throughput is not comparable with AVG_LIBC_THRUPUT.
      */
-    if (errors == 0) {
+    if (errors == 0 && stream) {
+	printf("No perf index with -S: streamed times include looking up block ids\n");
+    }
+    else if (errors == 0) {
 	avg_mm_throughput = ops/secs;
 
 	p1 = UTIL_WEIGHT * avg_mm_util;
@@ -367,7 +867,8 @@ int main(int argc, char **argv)
 
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
-	printf("perfidx:%.0f\n", perfindex);
+	if (!stream)
+	    printf("perfidx:%.0f\n", perfindex);
     }
 
     exit(0);
@@ -375,23 +876,78 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. It is a
+ * top-down splay tree keyed on the low address, so checking, adding
+ * and removing a block all take O(log n) amortized time, and the
+ * records come from pools that are kept for the next trace.
  ****************************************************************/
 
+/*
+ * splay_range - Splay the tree rooted at t around key, bringing the
+ *     range whose payload starts at key to the root, or, if there is
+ *     none, the range just before or just after where it would go.
+ */
+static range_t *splay_range(range_t *t, char *key)
+{
+    range_t n, *l, *r, *y;
+
+    n.left = n.right = NULL;
+    l = r = &n;
+    for (;;) {
+	if (key < t->lo) {
+	    if ((y = t->left) == NULL)
+		break;
+	    if (key < y->lo) {           /* zig-zig: rotate right */
+		t->left = y->right;
+		y->right = t;
+		t = y;
+		if (t->left == NULL)
+		    break;
+	    }
+	    r->left = t;                 /* link into the right tree */
+	    r = t;
+	    t = t->left;
+	}
+	else if (key > t->lo) {
+	    if ((y = t->right) == NULL)
+		break;
+	    if (key > y->lo) {           /* zag-zag: rotate left */
+		t->right = y->left;
+		y->left = t;
+		t = y;
+		if (t->right == NULL)
+		    break;
+	    }
+	    l->right = t;                /* link into the left tree */
+	    l = t;
+	    t = t->right;
+	}
+	else
+	    break;
+    }
+    l->right = t->left;                  /* reassemble */
+    r->left = t->right;
+    t->left = n.right;
+    t->right = n.left;
+    return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we take a range record for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *t;
+    range_pool_t *pool;
     char msg[MAXLINE];
+    int i;
 
     assert(size > 0);
 
@@ -403,19 +959,28 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a mapping */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
+    /* 
+     * The payload must not overlap any other payloads. The ranges are
+     * disjoint, so only the one starting closest below hi can overlap:
+     * splaying on hi brings it or its successor to the root, and in the
+     * second case splaying the left subtree brings it to that top.
+     */
+    if ((t = *ranges) != NULL) {
+	t = *ranges = splay_range(t, hi);
+	p = t;
+	if (t->lo > hi && (p = t->left) != NULL)
+	    p = t->left = splay_range(t->left, hi);
+	if (p != NULL && p->lo <= hi && p->hi >= lo) {
 	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
 		    lo, hi, p->lo, p->hi);
 	    malloc_error(tracenum, opnum, msg);
@@ -425,13 +990,37 @@ static int add_range(range_t **ranges, char *lo, int size,
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by taking a range record, growing the pool if it is empty,
+     * and splitting the tree around it.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    if (free_ranges == NULL) {
+	if ((pool = (range_pool_t *)malloc(sizeof(range_pool_t))) == NULL)
+	    unix_error("malloc error in add_range");
+	pool->next = range_pools;
+	range_pools = pool;
+	for (i = 0; i < RANGE_POOL_SIZE; i++) {
+	    pool->ranges[i].left = free_ranges;
+	    free_ranges = &pool->ranges[i];
+	}
+    }
+    p = free_ranges;
+    free_ranges = p->left;
     p->lo = lo;
     p->hi = hi;
+    p->left = p->right = NULL;
+    if (t != NULL) {
+	t = splay_range(t, lo);
+	if (lo < t->lo) {
+	    p->left = t->left;
+	    p->right = t;
+	    t->left = NULL;
+	}
+	else {
+	    p->right = t->right;
+	    p->left = t;
+	    t->right = NULL;
+	}
+    }
     *ranges = p;
     return 1;
 }
@@ -442,32 +1031,40 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    if (*ranges == NULL)
+	return;
+    p = *ranges = splay_range(*ranges, lo);
+    if (p->lo != lo)
+	return;
+
+    /* Splaying the left subtree on lo leaves its largest range on top
+       with no right child, ready to take over the right subtree */
+    if (p->left == NULL)
+	*ranges = p->right;
+    else {
+	*ranges = splay_range(p->left, lo);
+	(*ranges)->right = p->right;
     }
+    p->left = free_ranges;
+    free_ranges = p;
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - free all of the range records for a trace. There is
+ *     only ever one range tree, so every record in the pools is free.
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_pool_t *pool;
+    int i;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    free_ranges = NULL;
+    for (pool = range_pools; pool != NULL; pool = pool->next)
+	for (i = 0; i < RANGE_POOL_SIZE; i++) {
+	    pool->ranges[i].left = free_ranges;
+	    free_ranges = &pool->ranges[i];
+	}
     *ranges = NULL;
 }
 
@@ -477,32 +1074,40 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace is mapped by map_trace instead.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
     FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
+    trace_hdr_t hdr;
     char path[MAXLINE];
-    unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    int fd;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
 
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-	unix_error("malloc 1 failed in read_trance");
-	
-    /* Read the trace file header */
+    /* Open the trace file and see whether it is a binary trace */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
+    if ((fd = open(path, O_RDONLY)) < 0) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+    if (read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+	!memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)))
+	return map_trace(fd, path, &hdr);
+    if ((tracefile = fdopen(fd, "r")) == NULL || fseek(tracefile, 0, SEEK_SET) < 0)
+	unix_error("fdopen failed in read_trace");
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+	unix_error("malloc 1 failed in read_trance");
+	
+    /* Read the trace file header */
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -524,36 +1129,13 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	unix_error("malloc 4 failed in read_trace");
     
     /* read every request line in the trace file */
-    index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
+    while (op_index < trace->num_ops &&
+	   decode_op(tracefile, path, &trace->ops[op_index])) {
+	if (trace->ops[op_index].type != FREE)
+	    max_index = ((unsigned)trace->ops[op_index].index > max_index) ?
+		trace->ops[op_index].index : max_index;
 	op_index++;
-	
     }
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
@@ -562,6 +1144,228 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * decode_op - read the next request line of the .rep file tracefile
+ *     into op. Returns 0 at the end of the file.
+ */
+static int decode_op(FILE *tracefile, char *path, traceop_t *op)
+{
+    char type[MAXLINE];
+    unsigned index, size;
+
+    if (fscanf(tracefile, "%s", type) == EOF)
+	return 0;
+    switch(type[0]) {
+    case 'a':
+	fscanf(tracefile, "%u %u", &index, &size);
+	op->type = ALLOC;
+	op->index = index;
+	op->size = size;
+	break;
+    case 'r':
+	fscanf(tracefile, "%u %u", &index, &size);
+	op->type = REALLOC;
+	op->index = index;
+	op->size = size;
+	break;
+    case 'f':
+	fscanf(tracefile, "%ud", &index);
+	op->type = FREE;
+	op->index = index;
+	op->size = 0;
+	break;
+    default:
+	printf("Bogus type character (%c) in tracefile %s\n", 
+	       type[0], path);
+	exit(1);
+    }
+    return 1;
+}
+
+/*
+ * check_trace_hdr - make sure the binary trace at path, with header
+ *     hdr, was written by an mdriver whose records match ours.
+ */
+static void check_trace_hdr(trace_hdr_t *hdr, char *path)
+{
+    if (hdr->version != TRACE_VERSION || hdr->byte_order != TRACE_BYTE_ORDER ||
+	hdr->num_ids < 0 || hdr->num_ops < 0) {
+	printf("Binary tracefile %s does not match this mdriver\n", path);
+	exit(1);
+    }
+}
+
+/*
+ * unpack_op - widen the binary record of len bytes at rec into op.
+ *     Returns the record's length, or 0 if it is cut short or bogus:
+ *     an unknown type, an index that is not below num_ids, or a size
+ *     that is negative as an int or more than the heap could hold.
+ */
+static int unpack_op(unsigned char *rec, size_t len, int num_ids, traceop_t *op)
+{
+    uint32_t index, size = 0;
+    int n = BINOP_SIZE;
+
+    if (len < BINOP_FREE_SIZE)
+	return 0;
+    switch (rec[0]) {
+    case 'a':
+	op->type = ALLOC;
+	break;
+    case 'r':
+	op->type = REALLOC;
+	break;
+    case 'f':
+	op->type = FREE;
+	n = BINOP_FREE_SIZE;
+	break;
+    default:
+	return 0;
+    }
+    if (len < (size_t)n)
+	return 0;
+    memcpy(&index, rec + 1, sizeof(index));
+    if (n == BINOP_SIZE)
+	memcpy(&size, rec + 5, sizeof(size));
+    if (index >= (uint32_t)num_ids || size > INT_MAX || size > MAX_HEAP)
+	return 0;
+    op->index = index;
+    op->size = size;
+    return n;
+}
+
+/*
+ * map_trace - map the binary trace open on fd, whose header hdr has
+ *     already been read, and widen its records into trace->ops. Every
+ *     record is checked here, so a bad file fails before a run starts.
+ */
+static trace_t *map_trace(int fd, char *path, trace_hdr_t *hdr)
+{
+    trace_t *trace;
+    struct stat st;
+    unsigned char *map, *rec, *end;
+    int i, n;
+
+    check_trace_hdr(hdr, path);
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(trace_hdr_t)) {
+	printf("Binary tracefile %s is truncated\n", path);
+	exit(1);
+    }
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+	unix_error("malloc 1 failed in map_trace");
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    if ((trace->ops = 
+	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+	unix_error("malloc 2 failed in map_trace");
+
+    /* Map the file and widen the records that follow the header */
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    close(fd);
+    rec = map + sizeof(trace_hdr_t);
+    end = map + st.st_size;
+    for (i = 0; i < trace->num_ops; i++, rec += n)
+	if ((n = unpack_op(rec, end - rec, trace->num_ids, &trace->ops[i])) == 0) {
+	    printf("Bogus op %d in binary tracefile %s\n", i, path);
+	    exit(1);
+	}
+    munmap(map, st.st_size);
+    if (rec != end) {
+	printf("Binary tracefile %s has more than %d ops\n", path, trace->num_ops);
+	exit(1);
+    }
+
+    /* Same per-id arrays as read_trace */
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_trace");
+    return trace;
+}
+
+/*
+ * read_binop - read the next record of the binary trace binfile into
+ *     op. Returns 0 at the end of the file.
+ */
+static int read_binop(FILE *binfile, char *path, int num_ids, traceop_t *op)
+{
+    unsigned char rec[BINOP_SIZE];
+    int c;
+
+    if ((c = getc(binfile)) == EOF)
+	return 0;
+    rec[0] = c;
+    if (fread(rec + 1, 1, BINOP_FREE_SIZE - 1, binfile) != BINOP_FREE_SIZE - 1 ||
+	(c != 'f' && fread(rec + BINOP_FREE_SIZE, 1, BINOP_SIZE - BINOP_FREE_SIZE,
+			   binfile) != BINOP_SIZE - BINOP_FREE_SIZE) ||
+	!unpack_op(rec, BINOP_SIZE, num_ids, op)) {
+	printf("Bogus op in binary tracefile %s\n", path);
+	exit(1);
+    }
+    return 1;
+}
+
+/*
+ * write_trace - write a trace read from filename in tracedir as a
+ *     binary trace next to it, with .rep replaced by .bin.
+ */
+static void write_trace(char *tracedir, char *filename, trace_t *trace)
+{
+    FILE *binfile;
+    trace_hdr_t hdr;
+    unsigned char rec[BINOP_SIZE];
+    uint32_t index, size;
+    char path[MAXLINE];
+    char *ext;
+    int i;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((ext = strrchr(path, '.')) != NULL && !strcmp(ext, ".rep"))
+	*ext = '\0';
+    strcat(path, ".bin");
+    if ((binfile = fopen(path, "w")) == NULL) {
+	sprintf(msg, "Could not create %s in write_trace", path);
+	unix_error(msg);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.sugg_heapsize = trace->sugg_heapsize;
+    hdr.num_ids = trace->num_ids;
+    hdr.num_ops = trace->num_ops;
+    hdr.weight = trace->weight;
+    hdr.version = TRACE_VERSION;
+    hdr.byte_order = TRACE_BYTE_ORDER;
+    fwrite(&hdr, sizeof(hdr), 1, binfile);
+
+    /* A free has no size in a .rep file, so its record stops at the index */
+    for (i = 0; i < trace->num_ops; i++) {
+	rec[0] = trace->ops[i].type == ALLOC ? 'a' :
+	    trace->ops[i].type == REALLOC ? 'r' : 'f';
+	index = trace->ops[i].index;
+	memcpy(rec + 1, &index, sizeof(index));
+	if (trace->ops[i].type == FREE)
+	    fwrite(rec, BINOP_FREE_SIZE, 1, binfile);
+	else {
+	    size = trace->ops[i].size;
+	    memcpy(rec + 5, &size, sizeof(size));
+	    fwrite(rec, BINOP_SIZE, 1, binfile);
+	}
+    }
+    if (fclose(binfile) != 0)
+	unix_error("fclose failed in write_trace");
+    if (verbose > 1)
+	printf("Wrote binary tracefile: %s\n", path);
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
@@ -661,7 +1465,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -697,13 +1501,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest the heap got while running the student's malloc package
+ *   on the trace. mem_sbrk() lets the package shrink the heap, so that
+ *   is not necessarily its size at the end; both sizes go in stats.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, stats_t *stats)
 {   
     int i;
     int index;
@@ -782,30 +1585,687 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->peak_heap = mem_peak_heapsize();
+    stats->final_heap = mem_heapsize() + mem_mapsize();
+    return ((double)max_total_size / stats->peak_heap);
 }
 
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * eval_mm_threads - Used by fcyc() to time params->threads threads
+ *    replaying the same trace at the same time against a single mm
+ *    heap. Each thread keeps its own blocks array; the allocator must be
+ *    in thread-safe mode. There is no correctness checking here; that
+ *    was done by eval_mm_valid.
  */
-static void eval_mm_speed(void *ptr)
+static void eval_mm_threads(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    speed_t *params = (speed_t *)ptr;
+    int i;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
     if (mm_init() < 0) 
-	app_error("mm_init failed in eval_mm_speed");
-
-    /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+	app_error("mm_init failed in eval_mm_threads");
+
+    for (i = 0; i < params->threads; i++)
+	if (pthread_create(&params->replays[i].tid, NULL, replay_thread, 
+			   &params->replays[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_threads");
+    for (i = 0; i < params->threads; i++)
+	pthread_join(params->replays[i].tid, NULL);
+}
 
-        case ALLOC: /* mm_malloc */
+/*
+ * replay_thread - Runs one thread's replay of a trace for eval_mm_threads
+ */
+static void *replay_thread(void *vargp)
+{
+    replay_t *replay = (replay_t *)vargp;
+    trace_t *trace = replay->trace;
+    char **blocks = replay->blocks;
+    int i, index;
+    char *p;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in replay_thread");
+            blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in replay_thread");
+            blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+        }
+    }
+    return NULL;
+}
+
+/*
+ * eval_mm_handoff - Used by fcyc() to time one trace replayed by two
+ *    threads: the calling thread does every malloc and realloc and passes
+ *    each block the trace frees to a consumer thread, which frees it. So
+ *    every free is of a block from another thread's arena, and none of them
+ *    may still be waiting to go back to it once the consumer has exited.
+ */
+static void eval_mm_handoff(void *ptr)
+{
+    speed_t *params = (speed_t *)ptr;
+    handoff_t *h = params->handoff;
+    trace_t *trace = params->trace;
+    char **blocks = params->replays[0].blocks;
+    pthread_t consumer;
+    int i, index;
+    char *p;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_handoff");
+
+    h->head = h->tail = 0;
+    if (pthread_create(&consumer, NULL, handoff_consumer, h) != 0)
+	unix_error("pthread_create failed in eval_mm_handoff");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in eval_mm_handoff");
+            blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in eval_mm_handoff");
+            blocks[index] = p;
+            break;
+
+        case FREE: /* handed to the consumer */
+            handoff_put(h, blocks[index]);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_handoff");
+        }
+    }
+    handoff_put(h, NULL);
+    pthread_join(consumer, NULL);
+
+    /* The consumer has exited, so every block it freed must be back */
+    if (mm_remote_frees() > 0)
+	app_error("blocks freed by the consumer were never reclaimed in eval_mm_handoff");
+}
+
+/*
+ * handoff_put - Appends a block to the ring, waiting while it is full
+ */
+static void handoff_put(handoff_t *h, char *p)
+{
+    unsigned int tail = h->tail;
+
+    while (tail - __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) == HANDOFF_SLOTS)
+	sched_yield();
+    h->ring[tail % HANDOFF_SLOTS] = p;
+    __atomic_store_n(&h->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * handoff_consumer - Frees the blocks the producer hands over, in order,
+ *     until it hands over NULL
+ */
+static void *handoff_consumer(void *vargp)
+{
+    handoff_t *h = (handoff_t *)vargp;
+    unsigned int head = h->head;
+    char *p;
+
+    for (;;) {
+	while (__atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) == head)
+	    sched_yield();
+	p = h->ring[head % HANDOFF_SLOTS];
+	__atomic_store_n(&h->head, ++head, __ATOMIC_RELEASE);
+	if (p == NULL)
+	    return NULL;
+	mm_free(p);
+    }
+}
+
+/*
+ * eval_mm_streamed - Evaluates mm malloc on the trace filename in
+ *    tracedir, streamed from the file: checks it for correctness, and if
+ *    it is correct, measures its space utilization and then its running
+ *    time. Each of these is its own pass over the file, and the running
+ *    time is the fastest of STREAM_RUNS passes.
+ */
+static void eval_mm_streamed(char *tracedir, char *filename, int tracenum,
+			     range_t **ranges, stats_t *stats)
+{
+    char path[MAXLINE];
+    blocktab_t tab;
+    stats_t run;
+    int i;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", filename);
+
+    tab.mask = 1023;
+    if ((tab.slots = (blockent_t *)malloc((tab.mask + 1) * sizeof(blockent_t))) == NULL)
+	unix_error("malloc failed in eval_mm_streamed");
+
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = replay_stream(path, tracenum, STREAM_VALID, ranges, &tab, stats);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	replay_stream(path, tracenum, STREAM_UTIL, ranges, &tab, stats);
+	if (verbose > 1)
+	    printf("and performance.\n");
+	for (i = 0; i < STREAM_RUNS; i++) {
+	    replay_stream(path, tracenum, STREAM_SPEED, ranges, &tab, &run);
+	    if (i == 0 || run.secs < stats->secs)
+		stats->secs = run.secs;
+	}
+    }
+    free(tab.slots);
+}
+
+/*
+ * replay_stream - Replays the trace at path against mm malloc, one
+ *    chunk at a time, keeping its live blocks in tab. In STREAM_VALID
+ *    mode it makes the checks eval_mm_valid makes and returns 0 at the
+ *    first error; in STREAM_UTIL mode it fills in stats->util and the
+ *    heap sizes as eval_mm_util does; in STREAM_SPEED mode it sets
+ *    stats->secs to the time spent replaying chunks the reader has
+ *    already decoded, which leaves out opening the file, starting the
+ *    reader and waiting for it. stats->ops is set in all three.
+ */
+static int replay_stream(char *path, int tracenum, int mode, range_t **ranges,
+			 blocktab_t *tab, stats_t *stats)
+{
+    stream_t *s;
+    traceop_t *op;
+    blockent_t *e;
+    double total_size = 0, max_total_size = 0;
+    int i, j, k, n, b, oldsize;
+    char *p;
+    struct timespec start, end;
+
+    /* Reset the heap, the live blocks and any records in the range tree */
+    mem_reset_brk();
+    blocktab_clear(tab);
+    if (mode == STREAM_VALID)
+	clear_ranges(ranges);
+    if (mm_init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	return 0;
+    }
+
+    s = stream_open(path);
+    stats->ops = s->num_ops;
+    stats->secs = 0;
+
+    /* The reader ends with a chunk that is not full, perhaps an empty one */
+    for (i = 0, b = 0; ; b ^= 1) {
+	n = stream_next(s, b);
+	if (mode == STREAM_SPEED)
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < n; k++, i++) {
+	    op = &s->buf[b][k];
+	    if (op->index < 0 || op->index >= s->num_ids) {
+		printf("Bogus index %d in tracefile %s\n", op->index, path);
+		exit(1);
+	    }
+
+	    switch (op->type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(op->size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_malloc failed.");
+		    stream_close(s);
+		    return 0;
+		}
+		if (mode == STREAM_VALID) {
+		    if (add_range(ranges, p, op->size, tracenum, i) == 0) {
+			stream_close(s);
+			return 0;
+		    }
+		    memset(p, op->index & 0xFF, op->size);
+		}
+		e = blocktab_add(tab, op->index);
+		e->p = p;
+		e->size = op->size;
+		total_size += op->size;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		if ((e = blocktab_find(tab, op->index)) == NULL)
+		    app_error("Realloc of a block that is not allocated in replay_stream");
+		if ((p = mm_realloc(e->p, op->size)) == NULL) {
+		    malloc_error(tracenum, i, "mm_realloc failed.");
+		    stream_close(s);
+		    return 0;
+		}
+		if (mode == STREAM_VALID) {
+		    remove_range(ranges, e->p);
+		    if (add_range(ranges, p, op->size, tracenum, i) == 0) {
+			stream_close(s);
+			return 0;
+		    }
+		    oldsize = e->size < op->size ? e->size : op->size;
+		    for (j = 0; j < oldsize; j++)
+			if ((unsigned char)p[j] != (op->index & 0xFF)) {
+			    malloc_error(tracenum, i, "mm_realloc did not preserve the "
+					 "data from old block");
+			    stream_close(s);
+			    return 0;
+			}
+		    memset(p, op->index & 0xFF, op->size);
+		}
+		total_size += op->size - e->size;
+		e->p = p;
+		e->size = op->size;
+		break;
+
+	    case FREE: /* mm_free */
+		if ((e = blocktab_find(tab, op->index)) == NULL)
+		    app_error("Free of a block that is not allocated in replay_stream");
+		if (mode == STREAM_VALID)
+		    remove_range(ranges, e->p);
+		mm_free(e->p);
+		total_size -= e->size;
+		blocktab_remove(tab, e);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in replay_stream");
+	    }
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	}
+	if (mode == STREAM_SPEED) {
+	    clock_gettime(CLOCK_MONOTONIC, &end);
+	    stats->secs += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	}
+	stream_release(s, b);
+	if (n < STREAM_CHUNK)
+	    break;
+    }
+    if (i != s->num_ops) {
+	printf("Tracefile %s has %d requests, not %d\n", path, i, s->num_ops);
+	exit(1);
+    }
+    stream_close(s);
+
+    if (mode == STREAM_UTIL) {
+	stats->peak_heap = mem_peak_heapsize();
+	stats->final_heap = mem_heapsize() + mem_mapsize();
+	stats->util = max_total_size / stats->peak_heap;
+    }
+    return 1;
+}
+
+/*
+ * stream_open - Opens the trace at path, reads its header, and starts
+ *    a reader thread that fills the op buffers from the rest of it.
+ */
+static stream_t *stream_open(char *path)
+{
+    stream_t *s;
+    trace_hdr_t hdr;
+    int weight, sugg_heapsize;
+
+    if ((s = (stream_t *)calloc(1, sizeof(stream_t))) == NULL ||
+	(s->buf[0] = (traceop_t *)malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL ||
+	(s->buf[1] = (traceop_t *)malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+	unix_error("malloc failed in stream_open");
+    s->path = path;
+    if ((s->file = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in stream_open", path);
+	unix_error(msg);
+    }
+
+    /* A binary trace has its records right after its header */
+    if (fread(&hdr, sizeof(hdr), 1, s->file) == 1 &&
+	!memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))) {
+	check_trace_hdr(&hdr, path);
+	s->binary = 1;
+	s->num_ids = hdr.num_ids;
+	s->num_ops = hdr.num_ops;
+    }
+    else {
+	rewind(s->file);
+	if (fscanf(s->file, "%d %d %d %d", &sugg_heapsize, &s->num_ids,
+		   &s->num_ops, &weight) != 4) {
+	    printf("Bad header in tracefile %s\n", path);
+	    exit(1);
+	}
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->tid, NULL, stream_reader, s) != 0)
+	unix_error("pthread_create failed in stream_open");
+    return s;
+}
+
+/*
+ * stream_reader - The reader thread. Fills the two buffers in turn,
+ *    each as soon as the replay has given it back, until the end of
+ *    the file or until stream_close tells it to stop.
+ */
+static void *stream_reader(void *vargp)
+{
+    stream_t *s = (stream_t *)vargp;
+    int b, n, stop;
+
+    for (b = 0; ; b ^= 1) {
+	pthread_mutex_lock(&s->lock);
+	while (s->full[b] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	stop = s->stop;
+	pthread_mutex_unlock(&s->lock);
+	if (stop)
+	    break;
+
+	/* The buffer is the reader's until it is marked full */
+	if (s->binary)
+	    for (n = 0; n < STREAM_CHUNK &&
+		     read_binop(s->file, s->path, s->num_ids, &s->buf[b][n]); n++)
+		;
+	else
+	    for (n = 0; n < STREAM_CHUNK && decode_op(s->file, s->path, &s->buf[b][n]); n++)
+		;
+
+	pthread_mutex_lock(&s->lock);
+	s->count[b] = n;
+	s->full[b] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	if (n < STREAM_CHUNK)
+	    break;
+    }
+    return NULL;
+}
+
+/*
+ * stream_next - Waits for the reader to fill buffer b, and returns how
+ *    many ops it holds
+ */
+static int stream_next(stream_t *s, int b)
+{
+    int n;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->full[b])
+	pthread_cond_wait(&s->cond, &s->lock);
+    n = s->count[b];
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+/*
+ * stream_release - Gives buffer b back to the reader to refill
+ */
+static void stream_release(stream_t *s, int b)
+{
+    pthread_mutex_lock(&s->lock);
+    s->full[b] = 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * stream_close - Stops the reader, whether or not it got to the end,
+ *    and frees the stream
+ */
+static void stream_close(stream_t *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->tid, NULL);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    fclose(s->file);
+    free(s->buf[0]);
+    free(s->buf[1]);
+    free(s);
+}
+
+/*
+ * The block table hashes an id with Fibonacci hashing to its home
+ * slot and probes linearly from there. It doubles once it is half
+ * full, and a removal shifts later entries of the probe run back, so
+ * there are no tombstones.
+ */
+#define BLOCKTAB_HOME(tab, id) (((unsigned int)(id) * 2654435761u) & (tab)->mask)
+
+/*
+ * blocktab_clear - Empties the table, keeping its slots
+ */
+static void blocktab_clear(blocktab_t *tab)
+{
+    unsigned int i;
+
+    for (i = 0; i <= tab->mask; i++)
+	tab->slots[i].id = -1;
+    tab->count = 0;
+}
+
+/*
+ * blocktab_find - Returns the entry for block id, or NULL if the block
+ *    is not live
+ */
+static blockent_t *blocktab_find(blocktab_t *tab, int id)
+{
+    unsigned int i;
+
+    for (i = BLOCKTAB_HOME(tab, id); tab->slots[i].id != -1; i = (i + 1) & tab->mask)
+	if (tab->slots[i].id == id)
+	    return &tab->slots[i];
+    return NULL;
+}
+
+/*
+ * blocktab_add - Returns the entry for block id, adding one if the
+ *    block is not live yet
+ */
+static blockent_t *blocktab_add(blocktab_t *tab, int id)
+{
+    blockent_t *old, *e;
+    unsigned int i, n;
+
+    if ((e = blocktab_find(tab, id)) != NULL)
+	return e;
+
+    /* Double the table and move every entry to its new home */
+    if (2 * (tab->count + 1) > tab->mask + 1) {
+	old = tab->slots;
+	n = tab->mask + 1;
+	tab->mask = 2 * n - 1;
+	if ((tab->slots = (blockent_t *)malloc(2 * n * sizeof(blockent_t))) == NULL)
+	    unix_error("malloc failed in blocktab_add");
+	for (i = 0; i < 2 * n; i++)
+	    tab->slots[i].id = -1;
+	for (i = 0; i < n; i++)
+	    if (old[i].id != -1) {
+		for (e = &tab->slots[BLOCKTAB_HOME(tab, old[i].id)]; e->id != -1;
+		     e = &tab->slots[(e - tab->slots + 1) & tab->mask])
+		    ;
+		*e = old[i];
+	    }
+	free(old);
+    }
+
+    for (i = BLOCKTAB_HOME(tab, id); tab->slots[i].id != -1; i = (i + 1) & tab->mask)
+	;
+    tab->slots[i].id = id;
+    tab->count++;
+    return &tab->slots[i];
+}
+
+/*
+ * blocktab_remove - Removes entry e. Each later entry in the same probe
+ *    run moves into the hole if its home slot does not lie between the
+ *    hole and where it is now.
+ */
+static void blocktab_remove(blocktab_t *tab, blockent_t *e)
+{
+    unsigned int hole = e - tab->slots;
+    unsigned int i, home;
+
+    for (i = (hole + 1) & tab->mask; tab->slots[i].id != -1; i = (i + 1) & tab->mask) {
+	home = BLOCKTAB_HOME(tab, tab->slots[i].id);
+	if (((i - home) & tab->mask) >= ((i - hole) & tab->mask)) {
+	    tab->slots[hole] = tab->slots[i];
+	    hole = i;
+	}
+    }
+    tab->slots[hole].id = -1;
+    tab->count--;
+}
+
+/*
+ * job_start - Forks a worker to evaluate trace tracenum, first waiting
+ *     for a free slot among the njobs. Returns 1 in the driver, and 0
+ *     in the worker, which goes on to evaluate the trace.
+ */
+static int job_start(job_t *jobs, int njobs, int tracenum,
+		     stats_t *mm_stats, stats_t *hp_stats, int *hugepages)
+{
+    int fds[2];
+    int j;
+    pid_t pid;
+
+    for (;;) {
+	for (j = 0; j < njobs && jobs[j].pid != 0; j++)
+	    ;
+	if (j < njobs)
+	    break;
+	job_collect(jobs, njobs, mm_stats, hp_stats, hugepages);
+    }
+
+    /* Nothing buffered may be printed twice */
+    if (pipe(fds) < 0)
+	unix_error("pipe failed in job_start");
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+	unix_error("fork failed in job_start");
+    if (pid == 0) {
+	close(fds[0]);
+	for (j = 0; j < njobs; j++)
+	    if (jobs[j].pid != 0)
+		close(jobs[j].fd);
+	job_fd = fds[1];
+	errors = 0;
+	return 0;
+    }
+    close(fds[1]);
+    jobs[j].pid = pid;
+    jobs[j].fd = fds[0];
+    jobs[j].tracenum = tracenum;
+    return 1;
+}
+
+/*
+ * job_exit - Sends a worker's results for its trace to the driver and
+ *     ends the worker
+ */
+static void job_exit(stats_t *mm_stats, stats_t *hp_stats, int hugepages)
+{
+    jobresult_t res;
+
+    res.mm = *mm_stats;
+    res.hp = *hp_stats;
+    res.errors = errors;
+    res.hugepages = hugepages;
+    fflush(stdout);
+    if (write(job_fd, &res, sizeof(res)) != sizeof(res))
+	unix_error("write failed in job_exit");
+    exit(0);
+}
+
+/*
+ * job_collect - Waits for any worker to finish and stores its results.
+ *     A worker that died without sending them counts as an error on
+ *     its trace. Returns 0 if there were no workers left.
+ */
+static int job_collect(job_t *jobs, int njobs,
+		       stats_t *mm_stats, stats_t *hp_stats, int *hugepages)
+{
+    jobresult_t res;
+    int j, status;
+    pid_t pid;
+
+    do {
+	if ((pid = wait(&status)) < 0) {
+	    if (errno == ECHILD)
+		return 0;
+	    if (errno != EINTR)
+		unix_error("wait failed in job_collect");
+	}
+	for (j = 0; j < njobs && jobs[j].pid != pid; j++)
+	    ;
+    } while (pid < 0 || j == njobs);
+
+    /* The result is smaller than a pipe buffer, so it is all there */
+    if (read(jobs[j].fd, &res, sizeof(res)) == sizeof(res)) {
+	mm_stats[jobs[j].tracenum] = res.mm;
+	hp_stats[jobs[j].tracenum] = res.hp;
+	errors += res.errors;
+	*hugepages &= res.hugepages;
+    }
+    else {
+	printf("ERROR [trace %d]: worker died (status %d)\n", jobs[j].tracenum, status);
+	mm_stats[jobs[j].tracenum].valid = 0;
+	errors++;
+    }
+    close(jobs[j].fd);
+    jobs[j].pid = 0;
+    return 1;
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    int i, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_speed");
+
+    /* Interpret each trace request */
+    for (i = 0;  i < trace->num_ops;  i++)
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
             if ((p = mm_malloc(size)) == NULL)
@@ -833,6 +2293,111 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_latency - Time each request of a trace on its own and count
+ *    it, less overhead, in lat's histogram for its type. The trace is
+ *    replayed once untimed first, so that the timed replay finds the
+ *    heap's pages already committed and measures mm.c rather than the
+ *    kernel.
+ */
+static void eval_mm_latency(trace_t *trace, lat_t *lat, double overhead)
+{
+    int i, index;
+    char *p;
+    double cyc;
+    speed_t params;
+
+    params.trace = trace;
+    eval_mm_speed(&params);
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    start_counter();
+	    p = mm_malloc(trace->ops[i].size);
+	    cyc = get_counter();
+            if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    start_counter();
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    cyc = get_counter();
+            if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+	    start_counter();
+            mm_free(trace->blocks[index]);
+	    cyc = get_counter();
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	    return;
+        }
+	hist_add(&lat->hist[trace->ops[i].type], cyc - overhead);
+    }
+}
+
+/*
+ * hist_add - Count a value of cycles in h, as 0 if the overhead that
+ *    was taken off made it negative
+ */
+static void hist_add(hist_t *h, double cycles)
+{
+    uint64_t v = cycles > 0 ? (uint64_t)cycles : 0;
+    int i, shift;
+
+    if (v < HIST_SUB)
+	i = v;
+    else {
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+	i = HIST_SUB + (shift - 1) * (HIST_SUB/2) + (v >> shift) - HIST_SUB/2;
+    }
+    h->counts[i]++;
+    h->n++;
+    if (v > h->max)
+	h->max = v;
+}
+
+/*
+ * hist_percentile - The value that q of the values counted in h are
+ *    at or below, to within its bucket (reported as the bucket's top)
+ */
+static uint64_t hist_percentile(hist_t *h, double q)
+{
+    unsigned long want = (unsigned long)(q * h->n + 0.5);
+    unsigned long seen = 0;
+    uint64_t top;
+    int i, shift;
+
+    if (want < 1)
+	want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+	seen += h->counts[i];
+	if (seen >= want)
+	    break;
+    }
+    if (i < HIST_SUB)
+	top = i;
+    else {
+	shift = (i - HIST_SUB) / (HIST_SUB/2) + 1;
+	top = ((uint64_t)((i - HIST_SUB) % (HIST_SUB/2) + HIST_SUB/2 + 1) << shift) - 1;
+    }
+    return top < h->max ? top : h->max;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -924,50 +2489,114 @@ static void eval_libc_speed(void *ptr)
 
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * parse_fit_policy - select the mm.c placement policy from a -p argument
+ *     of the form first, next, exact, or best[:N]
  */
-static void printresults(int n, stats_t *stats) 
+static void parse_fit_policy(char *arg)
 {
-    int i;
+    int candidates = 0;
+    char *colon = strchr(arg, ':');
+
+    if (colon != NULL) {
+	*colon = '\0';
+	candidates = atoi(colon + 1);
+    }
+
+    if (!strcmp(arg, "first"))
+	mm_set_fit_policy(MM_FIT_FIRST, candidates);
+    else if (!strcmp(arg, "next"))
+	mm_set_fit_policy(MM_FIT_NEXT, candidates);
+    else if (!strcmp(arg, "best"))
+	mm_set_fit_policy(MM_FIT_BEST, candidates);
+    else if (!strcmp(arg, "exact"))
+	mm_set_fit_policy(MM_FIT_EXACT, candidates);
+    else {
+	usage();
+	exit(1);
+    }
+}
+
+/*
+ * printresults - prints a performance summary for some malloc package,
+ *     with the hardware events per op next to the throughput if events
+ */
+static void printresults(int n, stats_t *stats, int heaps, int events) 
+{
+    int i, j;
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double ops_n[PERFCTR_EVENTS];     /* the ops each event was counted over */
+    double events_n[PERFCTR_EVENTS];  /* ... and its count, or -1 */
+
+    for (j = 0; j < PERFCTR_EVENTS; j++) {
+	ops_n[j] = 0;
+	events_n[j] = -1;
+    }
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
+    printf("%5s%7s %5s%8s%10s%6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (events)
+	printf("%8s%8s%8s%8s%8s%8s", 
+	       "cyc/op", "ins/op", "L1D/op", "LLC/op", "TLB/op", "brm/op");
+    if (heaps)
+	printf("%9s%9s", "peak KB", "final KB");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (events) {
+		double trace_ops[PERFCTR_EVENTS];
+		for (j = 0; j < PERFCTR_EVENTS; j++) {
+		    trace_ops[j] = stats[i].ops;
+		    if (stats[i].events[j] >= 0) {
+			events_n[j] = (events_n[j] < 0 ? 0 : events_n[j]) +
+			    stats[i].events[j];
+			ops_n[j] += stats[i].ops;
+		    }
+		}
+		printevents(stats[i].events, trace_ops);
+	    }
+	    if (heaps)
+		printf("%9.0f%9.0f", stats[i].peak_heap/1024, stats[i].final_heap/1024);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
 		   "-");
+	    if (events)
+		printf("%8s%8s%8s%8s%8s%8s", "-", "-", "-", "-", "-", "-");
+	    if (heaps)
+		printf("%9s%9s", "-", "-");
 	}
+	printf("\n");
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (events)
+	    printevents(events_n, ops_n);
+	printf("\n");
     }
     else {
 	printf("%12s%6s%8s%10s%6s\n", 
@@ -980,6 +2609,96 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printevents - prints each hardware event count per op, or - if the
+ *     event was not counted
+ */
+static void printevents(double *counts, double *ops)
+{
+    int j;
+
+    for (j = 0; j < PERFCTR_EVENTS; j++) {
+	if (counts[j] < 0)
+	    printf("%8s", "-");
+	else if (j == PERFCTR_CYCLES || j == PERFCTR_INSTRUCTIONS)
+	    printf("%8.0f", counts[j]/ops[j]);
+	else
+	    printf("%8.3f", counts[j]/ops[j]);
+    }
+}
+
+/*
+ * printcompare - prints, for each trace, the time for a baseline run
+ *     and for another way of running it (scale times as much work, so
+ *     scale concurrent replays for -T), the throughput of the latter,
+ *     and its speedup over doing the same work the baseline way
+ */
+static void printcompare(int n, int scale, stats_t *base_stats, stats_t *stats,
+			 char *base_label, char *label)
+{
+    int i;
+    double base_secs = 0;
+    double secs = 0;
+    double ops = 0;
+
+    printf("%5s%9s%10s%10s%8s%8s\n", 
+	   "trace", "ops", base_label, label, "Kops", "speedup");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid) {
+	    printf("%2d%12.0f%10.6f%10.6f%8.0f%7.2fx\n",
+		   i,
+		   stats[i].ops,
+		   base_stats[i].secs,
+		   stats[i].secs,
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   (base_stats[i].secs*scale)/stats[i].secs);
+	    base_secs += base_stats[i].secs;
+	    secs += stats[i].secs;
+	    ops += stats[i].ops;
+	}
+	else {
+	    printf("%2d%12s%10s%10s%8s%8s\n", i, "-", "-", "-", "-", "-");
+	}
+    }
+    printf("%5s%9.0f%10.6f%10.6f%8.0f%7.2fx\n",
+	   "Total",
+	   ops,
+	   base_secs,
+	   secs,
+	   (ops/1e3)/secs,
+	   (base_secs*scale)/secs);
+}
+
+/*
+ * printlatency - prints, for each trace and each type of request in
+ *     it, how many there were and their median, p99, p99.9 and largest
+ *     latency, converting cycles to ns at mhz
+ */
+static void printlatency(int n, lat_t *lat, double mhz)
+{
+    static char *names[] = {"malloc", "free", "realloc"};
+    int i, t;
+    hist_t *h;
+
+    printf("%5s%9s%9s%8s%8s%8s%10s\n", 
+	   "trace", "request", "count", "p50", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+	for (t = 0; t < 3; t++) {
+	    h = &lat[i].hist[t];
+	    if (h->n == 0)
+		continue;
+	    printf("%2d%12s%9lu%8.0f%8.0f%8.0f%10.0f\n",
+		   i,
+		   names[t],
+		   h->n,
+		   hist_percentile(h, 0.5) * 1e3 / mhz,
+		   hist_percentile(h, 0.99) * 1e3 / mhz,
+		   hist_percentile(h, 0.999) * 1e3 / mhz,
+		   h->max * 1e3 / mhz);
+	}
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1012,14 +2731,26 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVaelLPbS] [-f <file>] [-t <dir>] [-p <policy>] [-T <n>] [-M <n>] [-R <n>] [-j <n>] [-c <timer>] [-H]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-b         Write each trace as a binary trace (.bin) and exit.\n");
+    fprintf(stderr, "\t-c <timer> Timer for throughput: fcyc (default), itimer, gettod.\n");
+    fprintf(stderr, "\t-e         Count hardware events per op in each trace (perf_event_open).\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Also time mm malloc on huge pages; both commit 2 MB at a time.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to n traces at once, each in its own process.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print p50/p99/p99.9/max latency of each request type.\n");
+    fprintf(stderr, "\t-M <n>     Map requests of n bytes or more on their own (0: never).\n");
+    fprintf(stderr, "\t-R <n>     Give blocks that realloc grows again up to n bytes of slack.\n");
+    fprintf(stderr, "\t-p <pol>   Placement policy: first, next, exact, best[:N].\n");
+    fprintf(stderr, "\t-P         Also time each trace with its frees on a second thread.\n");
+    fprintf(stderr, "\t-S         Stream each trace from its file instead of loading it.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also time each trace replayed on n threads at once, one arena each.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
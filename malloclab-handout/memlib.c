@@ -1,8 +1,16 @@
 /*
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
- *            with the system's malloc package in libc.
+ *            with the system's malloc package in libc. The heap is a
+ *            range of address space reserved with mmap, whose pages are
+ *            only committed as mem_sbrk grows into them and are given
+ *            back when it shrinks, so the process's RSS follows the heap.
+ *            The range can be backed by transparent huge pages on request.
+ *            Besides the sbrk heap memlib hands out page-granular
+ *            mappings, like mmap, which count towards the package's
+ *            footprint just the same.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +18,63 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#define HUGE_PAGE_SIZE (1 << 21)  /* transparent huge pages are 2 MB */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit_brk; /* end of the pages committed so far, at or above mem_brk */
+static size_t mem_unit;      /* pages are committed this many bytes at a time */
+static size_t mem_mapped;    /* bytes currently handed out by mem_map */
+static struct mapping { char *start; size_t size; } *mem_maps; /* ... and where */
+static int mem_nmaps, mem_maps_cap;
+static size_t mem_peak;      /* largest heap plus mappings since the last reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* guards all of the above */
+
+static void mem_decommit(char *addr);
+static void add_mapping(char *start, size_t size);
+static void remove_mapping(char *start);
+
+/* Remembers a new high for the heap and the mappings together; mem_lock is held */
+#define UPDATE_PEAK() { \
+    if ((size_t)(mem_brk - mem_start_brk) + mem_mapped > mem_peak) \
+	mem_peak = (size_t)(mem_brk - mem_start_brk) + mem_mapped; }
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    char *p;
+    size_t head;
+
+    /* reserve the address space we will use to model the available VM;
+       none of it is usable until mem_sbrk commits it. It starts on a
+       huge page boundary, so that huge pages can back all of it. */
+    p = mmap(NULL, MAX_HEAP + HUGE_PAGE_SIZE, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    head = (HUGE_PAGE_SIZE - (uintptr_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head)
+	munmap(p, head);
+    munmap(p + head + MAX_HEAP, HUGE_PAGE_SIZE - head);
+    mem_start_brk = p + head;
 
+    mem_unit = getpagesize();
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;           /* ... and nothing is committed */
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +82,165 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
+    free(mem_maps);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    The committed pages stay committed, as libc keeps its heap from one
+ *    timing run to the next, so the timings do not count page faults.
  */
 void mem_reset_brk()
 {
+    pthread_mutex_lock(&mem_lock);
     mem_brk = mem_start_brk;
+    mem_peak = mem_mapped;
+    pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area, or,
+ *    for a negative incr, shrinks it by -incr bytes and returns the old
+ *    brk. The heap cannot shrink below empty. Safe to call from several
+ *    threads at once.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    pthread_mutex_lock(&mem_lock);
+    old_brk = mem_brk;
+    if (incr < 0 && -(size_t)incr > (size_t)(mem_brk - mem_start_brk)) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Cannot shrink below an empty heap...\n");
+	return (void *)-1;
+    }
+    if (incr > 0 && incr > mem_max_addr - mem_brk) {
+	pthread_mutex_unlock(&mem_lock);
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+
+    /* commit the pages the heap grows into, or give back the ones it leaves */
+    if (mem_brk + incr > mem_commit_brk) {
+	char *end = mem_start_brk + (mem_brk + incr - mem_start_brk + mem_unit - 1)
+	    / mem_unit * mem_unit;
+	if (end > mem_max_addr)
+	    end = mem_max_addr;
+	if (mprotect(mem_commit_brk, end - mem_commit_brk, PROT_READ | PROT_WRITE) < 0) {
+	    pthread_mutex_unlock(&mem_lock);
+	    errno = ENOMEM;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	    return (void *)-1;
+	}
+	mem_commit_brk = end;
+    }
     mem_brk += incr;
+    if (incr < 0)
+	mem_decommit(mem_brk);
+    UPDATE_PEAK();
+    pthread_mutex_unlock(&mem_lock);
     return (void *)old_brk;
 }
 
+/*
+ * mem_set_hugepages - asks the system to back the heap with transparent
+ *    huge pages, or to stop. The committed pages above the brk are given
+ *    back so the next ones come in the new size; call it on an empty heap
+ *    for the whole heap to change. Memory is still committed and given
+ *    back in the same units either way; see mem_set_commit_huge. Returns
+ *    0, or -1 if the system cannot do it.
+ */
+int mem_set_hugepages(int enable)
+{
+    int rc;
+
+    pthread_mutex_lock(&mem_lock);
+    mem_decommit(mem_brk);
+    rc = madvise(mem_start_brk, MAX_HEAP, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    pthread_mutex_unlock(&mem_lock);
+    return rc;
+}
+
+/*
+ * mem_set_commit_huge - commits heap memory and gives it back a huge
+ *    page at a time, or a page at a time. Huge pages can only back a
+ *    heap that is committed in huge pages, so a heap timed on small
+ *    pages against huge ones should be committed this way for both.
+ */
+void mem_set_commit_huge(int enable)
+{
+    pthread_mutex_lock(&mem_lock);
+    mem_decommit(mem_brk);
+    mem_unit = enable ? HUGE_PAGE_SIZE : getpagesize();
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_map - simple model of an anonymous mmap. Returns size bytes of
+ *    fresh zeroed memory, which must be a multiple of mem_pagesize(),
+ *    outside the heap, or NULL if the system is out of memory.
+ */
+void *mem_map(size_t size)
+{
+    void *p;
+
+    if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+	return NULL;
+    }
+    pthread_mutex_lock(&mem_lock);
+    add_mapping(p, size);
+    mem_mapped += size;
+    UPDATE_PEAK();
+    pthread_mutex_unlock(&mem_lock);
+    return p;
+}
+
+/*
+ * mem_unmap - gives back a mapping of size bytes made by mem_map. Its
+ *    record goes under the same lock as the munmap, as otherwise another
+ *    thread's mem_map could be handed p and record it first.
+ */
+void mem_unmap(void *p, size_t size)
+{
+    pthread_mutex_lock(&mem_lock);
+    munmap(p, size);
+    remove_mapping(p);
+    mem_mapped -= size;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_remap - resizes a mapping made by mem_map from oldsize to newsize
+ *    bytes, both multiples of mem_pagesize(), like mremap. The contents
+ *    move along with it if it cannot grow where it is. Returns its new
+ *    address, or NULL (leaving the mapping alone) if that fails. As in
+ *    mem_unmap, the lock is held across the mremap.
+ */
+void *mem_remap(void *p, size_t oldsize, size_t newsize)
+{
+    void *newp;
+
+    pthread_mutex_lock(&mem_lock);
+    if ((newp = mremap(p, oldsize, newsize, MREMAP_MAYMOVE)) == MAP_FAILED) {
+	pthread_mutex_unlock(&mem_lock);
+	fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+	return NULL;
+    }
+    remove_mapping(p);
+    add_mapping(newp, newsize);
+    mem_mapped += newsize - oldsize;
+    UPDATE_PEAK();
+    pthread_mutex_unlock(&mem_lock);
+    return newp;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +265,88 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_is_mapped - returns 1 if the bytes lo through hi all lie in one
+ *    mapping currently handed out by mem_map
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    int i, found = 0;
+
+    pthread_mutex_lock(&mem_lock);
+    for (i = 0; i < mem_nmaps && !found; i++)
+	found = (char *)lo >= mem_maps[i].start &&
+	    (char *)hi < mem_maps[i].start + mem_maps[i].size;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
+/*
+ * mem_decommit - gives back every committed page wholly above addr and
+ *    makes it inaccessible again, like memory above a real brk; mem_lock
+ *    is held
+ */
+static void mem_decommit(char *addr)
+{
+    char *start = mem_start_brk + (addr - mem_start_brk + mem_unit - 1)
+	/ mem_unit * mem_unit;
+
+    if (start >= mem_commit_brk)
+	return;
+    madvise(start, mem_commit_brk - start, MADV_DONTNEED);
+    mprotect(start, mem_commit_brk - start, PROT_NONE);
+    mem_commit_brk = start;
+}
+
+/*
+ * add_mapping - records a new mapping; mem_lock is held
+ */
+static void add_mapping(char *start, size_t size)
+{
+    if (mem_nmaps == mem_maps_cap) {
+	mem_maps_cap = mem_maps_cap ? 2 * mem_maps_cap : 64;
+	if ((mem_maps = realloc(mem_maps, mem_maps_cap * sizeof(*mem_maps))) == NULL) {
+	    fprintf(stderr, "mem_map: realloc error\n");
+	    exit(1);
+	}
+    }
+    mem_maps[mem_nmaps].start = start;
+    mem_maps[mem_nmaps].size = size;
+    mem_nmaps++;
+}
+
+/*
+ * remove_mapping - forgets the mapping that starts at start; mem_lock
+ *    is held
+ */
+static void remove_mapping(char *start)
+{
+    int i;
+
+    for (i = 0; i < mem_nmaps; i++)
+	if (mem_maps[i].start == start) {
+	    mem_maps[i] = mem_maps[--mem_nmaps];
+	    return;
+	}
+}
+
+/*
+ * mem_mapsize() - returns the bytes currently handed out by mem_map
+ */
+size_t mem_mapsize() 
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest the heap and the mappings
+ *    together have been since the last reset, in bytes
+ */
+size_t mem_peak_heapsize() 
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
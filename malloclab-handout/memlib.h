@@ -1,11 +1,20 @@
 #include <unistd.h>
+#include <stdint.h>
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+void *mem_map(size_t size);
+void mem_unmap(void *p, size_t size);
+void *mem_remap(void *p, size_t oldsize, size_t newsize);
+int mem_is_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
+int mem_set_hugepages(int enable);
+void mem_set_commit_huge(int enable);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
@@ -3,19 +3,60 @@
  * Ethan Williams - ewilli24
  *
  * This allocator uses segregated free-lists in order to store all the free blocks.
- * We first implemented an explicit free-lists, then split it into two parts, and added conditions
- * to have these parts become small and large sized free-lists independent of each other.
+ * We first implemented an explicit free-list, then split it into two parts, and finally
+ * replaced the split with a table of size classes, each of which has its own list root.
+ *
+ * The size classes are linear (one class per ALIGNMENT step) up to SEG_LINEAR_MAX, and then
+ * power-of-two ranges above that. A bitmap with one bit per class records which lists are
+ * non-empty, so find_fit can jump straight to the first usable class instead of walking
+ * lists that can never satisfy the request.
+ *
+ * The last size class is not a list. Large free blocks go into a top-down splay tree ordered
+ * by (size, address), so a best-fit lookup, insert and delete are all O(log n) amortized no
+ * matter how many large blocks are free. A tree node keeps its left and right children in
+ * the same two payload words that a list block uses for next and previous.
+ *
+ * Requests of SLAB_MAX_SIZE bytes or less never reach the free-lists. They are served from slab
+ * pages: allocated blocks that hold an array of same-sized objects with no header each, a free
+ * bitmap, and a bump index for objects never handed out. Pages sit on SLAB_PAGE_SIZE boundaries
+ * and a bitmap over the whole heap marks which ones are slab pages, so mm_free can tell a slab
+ * object from a block without reading anything in front of it.
+ *
+ * Requests of mmap_threshold bytes or more (mm_set_mmap_threshold) skip all of that: each gets a
+ * page-granular mapping of its own from mem_map, with a MAPPED bit in its header, so it never
+ * fragments the heap, and realloc resizes the mapping rather than copying the block.
+ *
+ * All of the above lives in an arena. Single-threaded there is just one; in thread-safe mode
+ * (mm_set_thread_safe) there are mm_set_arenas() of them, each with its own lock, and threads
+ * are handed arenas round-robin. An arena grows in chunks of whole ARENA_GRANULEs, and a byte
+ * map with one entry per granule says which arena owns it, so mm_free finds a block's arena
+ * in O(1) without taking any shared lock. A block freed by a thread that does not own its arena
+ * goes onto that arena's lock-free remote-free stack, which the owner drains whenever it next
+ * takes its lock, and any thread drains on its way out. Each thread also keeps a small cache of slab objects per class, so most small
+ * requests and frees never touch a lock at all.
  *
  * The free-lists store next and previous pointers in the first two words of the payload which are
- * accessed and manipulated by various functions in this code.
+ * accessed and manipulated by various functions in this code. Each is a 32-bit offset from the
+ * start of the heap rather than an address, so a free block needs 16 bytes on 64-bit hosts too.
  *
  * Our freelists have the format:
  *
- * +----------------------+--------+------+-----------+---------------------------------+---------+------------------+
- * |         Word         |  Word  | Word |   Word    | free_list_(small|large)_pointer |  Word   |       Word       |
- * +----------------------+--------+------+-----------+---------------------------------+---------+------------------+
- * | (...Previous Footer) | Header | Next | Previous  | Data....                        | Footer  | (Next header...) |
- * +----------------------+--------+------+-----------+---------------------------------+---------+------------------+
+ * +----------------------+--------+------+-----------+----------------------+---------+------------------+
+ * |         Word         |  Word  | Word |   Word    | seg_roots[class]     |  Word   |       Word       |
+ * +----------------------+--------+------+-----------+----------------------+---------+------------------+
+ * | (...Previous Footer) | Header | Next | Previous  | Data....             | Footer  | (Next header...) |
+ * +----------------------+--------+------+-----------+----------------------+---------+------------------+
+ *
+ * Allocated blocks have only a header. Bit 1 of every header records whether the block
+ * before it is allocated, so coalesce only reads a footer when there is a free block there
+ * to read it from. This saves a word per allocation, which matters most for small requests.
+ * Allocated blocks have the format:
+ *
+ * +--------+----------------------+------------------+
+ * |  Word  |                      |       Word       |
+ * +--------+----------------------+------------------+
+ * | Header | Data....             | (Next header...) |
+ * +--------+----------------------+------------------+
  *
  * See the function headers and bodies for more detailed information about the workings of the program.
  */
@@ -24,8 +65,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /* Team structure */
 team_t team = {
@@ -39,59 +83,298 @@ team_t team = {
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
 #define CHUNKSIZE  (1<<14)  /* initial heap size (bytes) */
+#define TRIM_THRESHOLD (1<<19)  /* mm_free first trims a free block this big at the break (bytes) */
+#define TRIM_PAD   CHUNKSIZE    /* ... down to this much, so the next request need not grow it */
 #define OVERHEAD    8       /* overhead of header and footer (bytes) */
+#define ALLOC_OVERHEAD WSIZE /* overhead of an allocated block, which has no footer */
+#define LSIZE       WSIZE   /* size of a free-list link (bytes) */
+
+/* Payloads and block sizes are multiples of ALIGNMENT (config.h): 8, or 16 on LP64 */
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
 
-/* Read and write a word at address p */
-#define GET(p)       (*(size_t *)(p))
-#define PUT(p, val)  (*(size_t *)(p) = (val))  
+/* Read and write a word at address p. Header and footer words are 32 bits on every
+   target; a block never gets near 4 GB. */
+#define GET(p)       (*(uint32_t *)(p))
+#define PUT(p, val)  (*(uint32_t *)(p) = (val))  
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
-/* Given block ptr bp, compute address of its header and footer */
+// bit 1 of a header says whether the block before it is allocated. Only free blocks
+// have footers, so this bit is the only way to tell before reading PREV_BLKP.
+#define PREV_ALLOC 0x2
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+// writes a header without losing the prev-alloc bit already in it
+#define PUT_KEEP_PREV(p, val) PUT(p, (val) | GET_PREV_ALLOC(p))
+
+// sets or clears the prev-alloc bit in the header of block bp
+#define SET_PREV_ALLOC(bp)   PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLEAR_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
+
+/* Given block ptr bp, compute address of its header and footer (free blocks only) */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)  
 #define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks. PREV_BLKP reads
+   the previous block's footer, so it is only valid when that block is free. */
 #define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
+// a link is stored as a 32-bit offset from the start of the heap, so it takes one word
+// even on LP64. Offset 0 is the padding before the prologue and never a block, so it
+// doubles as NULL.
+#define LINK_ENCODE(p)   ((p) ? (uint32_t)((char *)(p) - heap_base) : 0)
+#define LINK_DECODE(off) link_decode(off)
+
 // gets the next or previous free block from the free list of bp
-#define GET_NEXT_FREE(bp) (size_t) GET(bp)
-#define GET_PREV_FREE(bp) (size_t) GET(bp + WSIZE)
+#define GET_NEXT_FREE(bp) LINK_DECODE(GET(bp))
+#define GET_PREV_FREE(bp) LINK_DECODE(GET((char *)(bp) + LSIZE))
 
 // sets the next or previous free block of bp
-#define SET_NEXT_FREE(bp, prevp) PUT(bp, (size_t)prevp)
-#define SET_PREV_FREE(bp, nextp) PUT(bp + WSIZE, (size_t)nextp)
+#define SET_NEXT_FREE(bp, nextp) PUT(bp, LINK_ENCODE(nextp))
+#define SET_PREV_FREE(bp, prevp) PUT((char *)(bp) + LSIZE, LINK_ENCODE(prevp))
 
 // sets this next to the next block and next's prev to this block
 #define CREATE_2WAY_LINK(thisbp, nextbp) SET_NEXT_FREE(thisbp, nextbp); SET_PREV_FREE(nextbp, thisbp)
 
-// checks size for segregated free-lists
-#define IS_SMALL(size) (size <= 192)
+/* Size class table for the segregated free-lists */
+#define SEG_MIN_BLOCK   ALIGN(OVERHEAD + 2*LSIZE) /* smallest block that can be free */
+#define SEG_LINEAR_STEP ALIGNMENT                 /* width of each linear class */
+#define SEG_LINEAR_MAX  128                       /* largest size with its own linear class */
+#define SEG_RANGE_CLASSES 3                       /* power-of-two classes below the tree */
+
+// number of linear classes; every class after these covers a power-of-two range
+#define SEG_LINEAR_CLASSES ((SEG_LINEAR_MAX - SEG_MIN_BLOCK) / SEG_LINEAR_STEP + 1)
+
+// total classes, one bit each in seg_bitmap
+#define SEG_NUM_CLASSES (SEG_LINEAR_CLASSES + SEG_RANGE_CLASSES + 1)
+
+// the last class is the splay tree; it takes every block larger than
+// SEG_LINEAR_MAX << SEG_RANGE_CLASSES, which is 1024 bytes
+#define SEG_TREE_CLASS (SEG_NUM_CLASSES - 1)
+
+// a tree node's children are stored where a list block keeps its next and previous links
+#define GET_LEFT(bp)       ((char *)GET_NEXT_FREE(bp))
+#define GET_RIGHT(bp)      ((char *)GET_PREV_FREE(bp))
+#define SET_LEFT(bp, lp)   SET_NEXT_FREE(bp, lp)
+#define SET_RIGHT(bp, rp)  SET_PREV_FREE(bp, rp)
+
+// orders tree nodes by size, and by address between blocks of the same size
+#define TREE_LESS(size1, bp1, size2, bp2) \
+	((size1) < (size2) || ((size1) == (size2) && (char *)(bp1) < (char *)(bp2)))
+
+// large blocks are carved from the high end of a free block and small ones from the low
+// end, so that one kind of block does not get stuck between two of the other kind.
+#define PLACE_AT_END_MIN 96
+#define IS_PLACED_AT_END(asize) ((asize) >= PLACE_AT_END_MIN)
+
+// marks a class list of arena a as empty or non-empty in its occupancy bitmap
+#define SEG_MARK(a, cls)   ((a)->seg_bitmap |= (1u << (cls)))
+#define SEG_UNMARK(a, cls) ((a)->seg_bitmap &= ~(1u << (cls)))
+
+/* Slab layer for small requests */
+#define SLAB_MAX_SIZE   64    /* largest request served from a slab page */
+#define SLAB_PAGE_SIZE  1024  /* size of a slab page, which is also its alignment */
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / ALIGNMENT) /* one class per ALIGNMENT step */
+
+// request size -> slab class, and slab class -> object size
+#define SLAB_CLASS(size) (ALIGN(size) / ALIGNMENT - 1)
+#define SLAB_OSIZE(cls)  (((cls) + 1) * ALIGNMENT)
+
+// a page holds at most this many objects, one bit each in its free bitmap
+#define SLAB_MAX_OBJS   (SLAB_PAGE_SIZE / ALIGNMENT)
+#define SLAB_MAP_WORDS  ((SLAB_MAX_OBJS + 31) / 32)
+
+// the page header comes first; objects start on the next ALIGNMENT boundary
+#define SLAB_HDR_SIZE   ALIGN(sizeof(slab_t))
+
+// one bit per page-sized piece of the heap, set when a slab page starts there. In
+// thread-safe mode it is read without the heap lock, so every access is atomic.
+#define SLAB_PAGE_INDEX(p)  ((size_t)((char *)(p) - heap_base) / SLAB_PAGE_SIZE)
+#define SLAB_IS_PAGE(i) \
+	(__atomic_load_n(&slab_pagemap[(i) / 32], __ATOMIC_RELAXED) & (1u << ((i) % 32)))
+#define SLAB_PAGEMAP_SET(i) \
+	__atomic_fetch_or(&slab_pagemap[(i) / 32], 1u << ((i) % 32), __ATOMIC_RELAXED)
+#define SLAB_PAGEMAP_CLEAR(i) \
+	__atomic_fetch_and(&slab_pagemap[(i) / 32], ~(1u << ((i) % 32)), __ATOMIC_RELAXED)
+#define SLAB_OWNS(p)        SLAB_IS_PAGE(SLAB_PAGE_INDEX(p))
+#define SLAB_PAGE_OF(p)     ((slab_t *)(heap_base + SLAB_PAGE_INDEX(p) * SLAB_PAGE_SIZE))
 
-// checks address to determine which free-list a block is in
-#define IS_IN_SMALL_REGION(ptr) ((char*)ptr < interlude_p)
+/*
+ * Header at the start of every slab page. The page itself is an ordinary allocated block
+ * as far as the rest of the heap is concerned; its objects carry no headers of their own.
+ * Objects below bump have been handed out at least once, and a set bit in freemap marks
+ * one of those that has since been freed.
+ */
+typedef struct {
+    uint32_t next;     /* next page of this class with a free object, as a heap offset */
+    uint32_t prev;     /* previous such page, as a heap offset */
+    uint16_t osize;    /* object size (bytes) */
+    uint16_t cap;      /* how many objects fit in the page */
+    uint16_t nused;    /* objects currently allocated */
+    uint16_t bump;     /* objects carved from the page so far */
+    uint32_t freemap[SLAB_MAP_WORDS];
+} slab_t;
+
+/* Mapped blocks */
+#define MMAP_THRESHOLD (1<<20)  /* default smallest request given a mapping of its own (bytes) */
+
+// bit 2 of a header marks a block that is a mapping of its own rather than part of the heap
+#define MAPPED 0x4
+
+// a heap block is told apart from a mapped one by its address, so bit 2 is spare in its
+// header; there it marks a block that realloc has grown before
+#define REGROWN 0x4
+#define IS_REGROWN(bp)  (GET(HDRP(bp)) & REGROWN)
+#define SET_REGROWN(bp) PUT(HDRP(bp), GET(HDRP(bp)) | REGROWN)
+
+/* Realloc headroom */
+#define REALLOC_HEADROOM (1<<14) /* default cap on the slack given to a block that grows again (bytes) */
+
+// a block that grows again gets a quarter of its new size on top, up to realloc_headroom
+#define REALLOC_ROOM(asize) MIN(ALIGN((asize) / 4), realloc_headroom)
+
+// the heap is one fixed region of MAX_HEAP bytes, so anything outside it came from mem_map.
+// Slab objects have no header to read a MAPPED bit from, so this is always asked first.
+#define IS_MAPPED(bp) ((uintptr_t)(bp) - (uintptr_t)heap_base >= MAX_HEAP)
+
+// a mapped block's header holds the offset back to the start of its mapping
+#define MAP_HDR_SIZE  ALIGN(sizeof(map_t) + ALLOC_OVERHEAD)
+#define MAP_OF(bp)    ((map_t *)((char *)(bp) - GET_SIZE(HDRP(bp))))
+
+// whole pages needed to map a payload of size bytes
+#define MAP_SIZE(size) \
+	(((size) + MAP_HDR_SIZE + mem_pagesize() - 1) / mem_pagesize() * mem_pagesize())
+
+// guards map_list in thread-safe mode
+#define MAP_LOCK()   { if (thread_safe) pthread_mutex_lock(&map_lock); }
+#define MAP_UNLOCK() { if (thread_safe) pthread_mutex_unlock(&map_lock); }
+
+/*
+ * The start of a mapping that holds one large block, followed by the block's header and
+ * payload. Every live mapping is on map_list, so mm_init can give back any that the last
+ * heap left behind and mm_checkheap can find them.
+ */
+typedef struct map {
+    size_t size;              /* bytes mapped, a whole number of pages */
+    struct map *prev, *next;  /* neighbours on map_list */
+} map_t;
+
+/* Per-thread caches used in thread-safe mode */
+#define TCACHE_BATCH 16                 /* objects moved to or from the slab pages at once */
+#define TCACHE_MAX   (2 * TCACHE_BATCH) /* a class holding more than this is flushed */
+
+// the first word of a cached object links it to the next one in its class
+#define TCACHE_NEXT(bp) (*(char **)(bp))
+
+/* Arenas */
+#define MAX_ARENAS    16    /* most arenas mm_set_arenas() can ask for */
+#define ARENA_GRANULE 4096  /* arenas take memory from mem_sbrk in multiples of this */
+
+// every ARENA_GRANULE bytes of the heap belong to one arena, recorded in arena_map
+#define ARENA_OF(p) (&arenas[arena_map[(size_t)((char *)(p) - heap_base) / ARENA_GRANULE]])
+
+// an arena's lock, which is only taken in thread-safe mode
+#define ARENA_LOCK(a)   pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+
+// orders the arenas' moves of the break in thread-safe mode; always taken inside an arena lock
+#define BRK_LOCK()   { if (thread_safe) pthread_mutex_lock(&brk_lock); }
+#define BRK_UNLOCK() { if (thread_safe) pthread_mutex_unlock(&brk_lock); }
+
+// the first word of a block waiting on an arena's remote-free stack links it to the next one
+#define REMOTE_NEXT(bp) (*(char **)(bp))
+
+/*
+ * An independent allocator: its own size classes, slab classes and lock. An arena's memory
+ * is a series of chunks from mem_sbrk, each with its own prologue and epilogue, so blocks
+ * never coalesce across arenas. When an arena's newest chunk still ends at the break, the
+ * next chunk it asks for simply extends it.
+ *
+ * A thread freeing a block that belongs to some other thread's arena does not take that
+ * arena's lock. It pushes the block onto remote_frees, a lock-free stack with many pushers
+ * and a single popper, and the arena's own thread frees the whole stack at once the next
+ * time it holds the lock to allocate or free. A thread that exits frees every stack it
+ * finds non-empty, so blocks freed after their owner's last call still come back.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    char *seg_roots[SEG_NUM_CLASSES];    // the segregated list pointers, one per size class
+    unsigned int seg_bitmap;             // bit i is set when seg_roots[i] is non-empty
+    char *seg_rovers[SEG_NUM_CLASSES];   // where the next next-fit search of each class starts
+    slab_t *slab_heads[SLAB_NUM_CLASSES]; // pages of each slab class with a free object
+    char *chunk_end;                     // end of the newest chunk, NULL before the first
+    char *remote_frees;                  // blocks other threads freed, pushed without the lock
+    size_t trim_threshold;               // how big a free block at the break mm_free trims
+    int trimmed;                         // set when the break was last moved by heap_trim
+} arena_t;
+
+/*
+ * A thread's private stock of slab objects, one stack per slab class, and the arena it
+ * was assigned. Small requests are served from here without a lock; an arena lock is
+ * only taken to move a batch of objects between the cache and the slab pages. generation
+ * ties the cache to one mm_init, so objects left over from an earlier heap are never
+ * handed out.
+ */
+typedef struct {
+    unsigned int generation;
+    arena_t *arena;    /* where this thread's new blocks come from */
+    int count[SLAB_NUM_CLASSES];
+    char *head[SLAB_NUM_CLASSES];
+} tcache_t;
 
 // prints error-checking code
 #define DEBUG_HEAPS(msg) \
-	condprintf("\tfree_list_small_root_p: " msg "\n");\
+	condprintf("\tseg_roots: " msg "\n");\
 	mm_checkheap(1)
 
 /* $end mallocmacros */
 
 /* Global variables */
-char *free_list_small_root_p; // the segregated list pointer for small items: size <= 192
-char *free_list_large_root_p; // the segregated list pointer for the big items: size > 192
-char hasFinishedInit; // used for a special case of coalescing in the beginning.
-char* interlude_p; // used to delineate the two lists
-char *heap_listp;  /* pointer to first block */  
+char *heap_base;   /* mem_heap_lo(), which free-list links are offsets from */
+
+// the arenas, and which one owns each ARENA_GRANULE of the heap
+arena_t arenas[MAX_ARENAS];
+int num_arenas;
+int init_num_arenas = 1;
+unsigned char arena_map[MAX_HEAP / ARENA_GRANULE];
+unsigned int next_arena; // round-robin counter for handing arenas to threads
+pthread_mutex_t brk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the map of all slab pages
+uint32_t slab_pagemap[(MAX_HEAP / SLAB_PAGE_SIZE + 31) / 32];
+
+// placement policy in use, and the one mm_set_fit_policy() asked mm_init() to use
+int fit_policy;
+int fit_max_candidates; // how many fitting blocks best-fit looks at per class
+int init_fit_policy = MM_FIT_FIRST;
+int init_fit_max_candidates = 8;
+
+// thread-safe mode in use, and the one mm_set_thread_safe() asked mm_init() to use
+int thread_safe;
+int init_thread_safe;
+
+// the live mappings, and the smallest request that gets one (in use, and for mm_init)
+map_t *map_list;
+size_t mmap_threshold;
+size_t init_mmap_threshold = MMAP_THRESHOLD;
+pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the cap on realloc headroom in use, and the one mm_set_realloc_headroom() asked for
+size_t realloc_headroom;
+size_t init_realloc_headroom = REALLOC_HEADROOM;
+unsigned int heap_generation; // counts mm_init calls, so stale thread caches can be spotted
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key; // its destructor flushes a thread's cache when it exits
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
 // determines whether conditional prints run
 int DEBUG_MODE = 1;
@@ -101,85 +384,432 @@ int DEBUG_MODE = 1;
   } \
 }
 
+/* 
+ * Turns a free-list link back into a block pointer. A function rather than a macro
+ * so that callers can test the result against NULL without compiler warnings.
+ */
+static inline char *link_decode(uint32_t off)
+{
+    return off ? heap_base + off : NULL;
+}
+
 /* function prototypes for internal helper routines */
-static void *extend_heap(size_t words);
-static void place(void *bp, size_t asize);
-static void *find_fit(size_t asize);
-static void *coalesce(void *bp);
+static void *extend_heap(arena_t *a, size_t words);
+static int heap_trim(arena_t *a, size_t pad);
+static void *place(arena_t *a, void *bp, size_t asize, int from_end);
+static void trim_block(arena_t *a, void *bp, size_t csize, size_t asize);
+static void *find_fit(arena_t *a, size_t asize);
+static void *coalesce(arena_t *a, void *bp);
 static void checkblock(void *bp);
 
 // more helpers that we made 
-static void dissociateBlockFromList(void* bp);
-static void insertFreeBlockAtBeginning(void* bp);
+static void dissociateBlockFromList(arena_t *a, void* bp);
+static void insertFreeBlockAtBeginning(arena_t *a, void* bp);
+static int seg_class(size_t size);
+static void *search_class(arena_t *a, int cls, size_t asize, int any_fits);
+static char *tree_splay(char *t, size_t size, char *key);
+static void tree_insert(arena_t *a, void *bp);
+static void tree_remove(arena_t *a, void *bp);
+static void *tree_find_fit(arena_t *a, size_t asize);
+static int checktree(char *t, int verbose);
+static void checkarena(arena_t *a, int verbose);
 static void condPrintblockExtra(void *bp);
+static void *slab_malloc(arena_t *a, size_t size);
+static void slab_free(arena_t *a, void *bp);
+static slab_t *slab_page_new(arena_t *a, int cls);
+static void slab_page_release(arena_t *a, slab_t *s, int cls);
+static void slab_list_remove(arena_t *a, slab_t *s, int cls);
+static void *heap_malloc(arena_t *a, size_t size);
+static void heap_free(arena_t *a, void *bp);
+static void *heap_realloc(arena_t *a, void *ptr, size_t size);
+static tcache_t *tcache_get(void);
+static void tcache_release(tcache_t *tc, int cls, int n);
+static void tcache_flush(void *arg);
+static void remote_push(arena_t *a, char *bp);
+static void remote_drain(arena_t *a);
+static void *map_malloc(size_t size);
+static void map_free(void *bp);
+static void *map_realloc(void *bp, size_t size);
 
 // forward dec of the checker
 void mm_checkheap(int verbose);
 
 /* 
- * Initializes two free-lists by allocating space for smaller blocks in the first part of
- * the heap. Keeps large and small blocks separate using a small allocated block in between
- * the main sections of the heap. Initializes root pointers to the first two free blocks.
+ * Empties every arena's size and slab classes and gives arena 0 its first chunk: a
+ * prologue, one free block and an epilogue. Which list a block lives in depends only
+ * on its size, so each chunk coalesces freely across its address range. The other
+ * arenas get their first chunk when a thread first allocates from them.
  */
 /* $begin mminit */
 int mm_init(void) {
+    map_t *m;
+    int i;
 
-    // handles a special case of coalescing. 
-    hasFinishedInit = 0;
+    // mappings are not part of the heap, so resetting the heap does not free them.
+    while ((m = map_list) != NULL) {
+	map_list = m->next;
+	mem_unmap(m, m->size);
+    }
+    mmap_threshold = init_mmap_threshold;
+    realloc_headroom = init_realloc_headroom;
+
+    heap_base = mem_heap_lo();
+
+    // every arena starts out with no chunks and every class empty.
+    thread_safe = init_thread_safe;
+    num_arenas = thread_safe ? init_num_arenas : 1;
+    for (i = 0; i < num_arenas; i++) {
+	memset(&arenas[i], 0, sizeof(arenas[i]));
+	pthread_mutex_init(&arenas[i].lock, NULL);
+	arenas[i].trim_threshold = TRIM_THRESHOLD;
+    }
+    next_arena = 0;
 
-    /* create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4*WSIZE)) == NULL)
-	return -1;
-    PUT(heap_listp, 0);                        /* alignment padding */
-    PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));  /* prologue header */ 
-    PUT(heap_listp+DSIZE, PACK(OVERHEAD, 1));  /* prologue footer */ 
-    PUT(heap_listp+WSIZE+DSIZE, PACK(0, 1));   /* epilogue header */
+    // the rovers were just reset, so this is the safe point to switch policy.
+    fit_policy = init_fit_policy;
+    fit_max_candidates = init_fit_max_candidates;
 
-    heap_listp += DSIZE;
+    // every thread cache from the last heap is now stale.
+    heap_generation++;
 
-    // 25 % of the heap storage initially is for the small list.
-    if ((free_list_small_root_p = extend_heap(CHUNKSIZE/WSIZE/4)) == NULL)
+    // the first free block is put into its size class by coalesce().
+    if (extend_heap(&arenas[0], CHUNKSIZE/WSIZE) == NULL)
 	return -1;
 
-    // initialize the links in the new small linked list
-    SET_NEXT_FREE(free_list_small_root_p, 0);
-    SET_PREV_FREE(free_list_small_root_p, 0);
+    // mm_checkheap(1);
+    return 0;
+}
+/* $end mminit */
 
-    // this "interlude_p" is used to delineate the two lists, just like a prologue header/footer.
-    interlude_p = NEXT_BLKP(free_list_small_root_p) - WSIZE - DSIZE;
-    PUT(interlude_p, PACK(OVERHEAD, 1)); /* interlude header */
-    PUT(interlude_p + WSIZE, PACK(OVERHEAD, 1)); /* interlude footer */
+/*
+ * Chooses the placement policy used by find_fit (one of the MM_FIT_* constants in mm.h).
+ * max_candidates bounds how many fitting blocks best-fit compares in a class; values
+ * below 1 keep the current bound. Takes effect at the next mm_init.
+ */
+void mm_set_fit_policy(int policy, int max_candidates)
+{
+    init_fit_policy = policy;
+    if (max_candidates > 0)
+	init_fit_max_candidates = max_candidates;
+}
 
-    // resize the small list to put an interim separator, so that the lists cannot enter eachother.
-    size_t newSmallSize = (size_t)GET_SIZE(HDRP(free_list_small_root_p)) - (size_t)DSIZE;
-    char smallAlloc = GET_ALLOC(HDRP(free_list_small_root_p));
-    PUT(HDRP(free_list_small_root_p), PACK(newSmallSize, smallAlloc));
-    PUT(FTRP(free_list_small_root_p), PACK(newSmallSize, smallAlloc));
+/*
+ * Turns thread-safe mode on or off. Takes effect at the next mm_init, which must not
+ * run while other threads are inside the allocator.
+ */
+void mm_set_thread_safe(int enable)
+{
+    init_thread_safe = enable;
+}
 
-    // 75 % of the heap storage initially is for the large lists.
-    if ((free_list_large_root_p = extend_heap(CHUNKSIZE/WSIZE/4 * 3)) == NULL)
-	return -1;
+/*
+ * Sets how many arenas thread-safe mode spreads its threads over, clamped to
+ * 1..MAX_ARENAS. Takes effect at the next mm_init.
+ */
+void mm_set_arenas(int n)
+{
+    init_num_arenas = n < 1 ? 1 : n > MAX_ARENAS ? MAX_ARENAS : n;
+}
 
-    // initialize the links in the large list.
-    SET_NEXT_FREE(free_list_large_root_p, 0);
-    SET_PREV_FREE(free_list_large_root_p, 0);
+/*
+ * Sets the smallest request that gets a mapping of its own instead of a place in the
+ * heap; 0 turns mappings off. Takes effect at the next mm_init.
+ */
+void mm_set_mmap_threshold(size_t threshold)
+{
+    init_mmap_threshold = threshold ? MAX(threshold, SLAB_MAX_SIZE + 1) : (size_t)-1;
+}
 
-    // handles a special case of coalescing.
-    hasFinishedInit = 1;
+/*
+ * Sets the most slack mm_realloc adds to a block that it has grown before, so that the
+ * next grow can happen in place; 0 turns headroom off. Takes effect at the next mm_init.
+ */
+void mm_set_realloc_headroom(size_t cap)
+{
+    init_realloc_headroom = cap;
+}
 
-    // mm_checkheap(1);
-    return 0;
+/*
+ * Shrinks the heap so that at most pad bytes stay free at its top, like malloc_trim.
+ * mm_free already does this on its own whenever the free block at the top grows past
+ * its arena's trim threshold. Returns 1 if any memory went back to memlib.
+ */
+int mm_trim(size_t pad)
+{
+    arena_t *a;
+    int trimmed = 0;
+
+    if (!thread_safe)
+	return heap_trim(&arenas[0], pad);
+
+    for (a = arenas; a < arenas + num_arenas; a++) {
+	ARENA_LOCK(a);
+	remote_drain(a);
+	trimmed |= heap_trim(a, pad);
+	ARENA_UNLOCK(a);
+    }
+    return trimmed;
+}
+
+/*
+ * Counts the blocks still waiting on remote-free stacks for their arena to take them
+ * back. Call it only while no thread is freeing; it walks the stacks without a lock.
+ */
+size_t mm_remote_frees(void)
+{
+    arena_t *a;
+    char *bp;
+    size_t n = 0;
+
+    for (a = arenas; a < arenas + num_arenas; a++)
+	for (bp = __atomic_load_n(&a->remote_frees, __ATOMIC_ACQUIRE); bp; bp = REMOTE_NEXT(bp))
+	    n++;
+    return n;
+}
+
+/*
+ * Allocates a block of at least size bytes. In thread-safe mode small requests come
+ * from the calling thread's cache, refilled from the slab pages of the thread's arena a
+ * batch at a time, and everything else takes that arena's lock around heap_malloc.
+ */
+void *mm_malloc(size_t size)
+{
+    tcache_t *tc;
+    char *bp;
+    int cls;
+
+    if (!thread_safe)
+	return heap_malloc(&arenas[0], size);
+
+    if (size >= mmap_threshold)
+	return map_malloc(size);
+
+    tc = tcache_get();
+    if (size == 0 || size > SLAB_MAX_SIZE) {
+	ARENA_LOCK(tc->arena);
+	remote_drain(tc->arena);
+	bp = heap_malloc(tc->arena, size);
+	ARENA_UNLOCK(tc->arena);
+	return bp;
+    }
+
+    cls = SLAB_CLASS(size);
+    if (!tc->head[cls]) {
+	ARENA_LOCK(tc->arena);
+	remote_drain(tc->arena);
+	while (tc->count[cls] < TCACHE_BATCH &&
+	       (bp = slab_malloc(tc->arena, SLAB_OSIZE(cls))) != NULL) {
+	    TCACHE_NEXT(bp) = tc->head[cls];
+	    tc->head[cls] = bp;
+	    tc->count[cls]++;
+	}
+	ARENA_UNLOCK(tc->arena);
+	if (!tc->head[cls])
+	    return NULL;
+    }
+
+    bp = tc->head[cls];
+    tc->head[cls] = TCACHE_NEXT(bp);
+    tc->count[cls]--;
+    return bp;
+}
+
+/*
+ * Frees a block. In thread-safe mode a slab object goes into the calling thread's cache,
+ * whichever thread allocated it, and a batch goes back to the slab pages once the cache
+ * holds too many. Other blocks take the thread's own arena lock around heap_free, or go
+ * onto the remote-free stack of the arena that owns them, found through arena_map.
+ */
+void mm_free(void *bp)
+{
+    tcache_t *tc;
+    arena_t *a;
+    int cls;
+
+    if (!thread_safe) {
+	heap_free(&arenas[0], bp);
+	return;
+    }
+
+    if (bp == NULL)
+	return;
+
+    if (IS_MAPPED(bp)) {
+	map_free(bp);
+	return;
+    }
+
+    tc = tcache_get();
+    if (!SLAB_OWNS(bp)) {
+	if ((a = ARENA_OF(bp)) != tc->arena) {
+	    remote_push(a, bp);
+	    return;
+	}
+	ARENA_LOCK(a);
+	remote_drain(a);
+	heap_free(a, bp);
+	ARENA_UNLOCK(a);
+	return;
+    }
+
+    cls = SLAB_CLASS(SLAB_PAGE_OF(bp)->osize);
+    TCACHE_NEXT(bp) = tc->head[cls];
+    tc->head[cls] = bp;
+
+    if (++tc->count[cls] > TCACHE_MAX)
+	tcache_release(tc, cls, TCACHE_BATCH);
+}
+
+/*
+ * Resizes a block. A slab object that still fits its slot, and a mapped block that stays
+ * mapped, need no lock; anything else takes the lock of the arena that owns the block (or
+ * the thread's own arena for a NULL ptr or a mapped block) around heap_realloc in
+ * thread-safe mode.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    arena_t *a;
+    void *newp;
+
+    if (!thread_safe)
+	return heap_realloc(&arenas[0], ptr, size);
+
+    if (ptr != NULL && IS_MAPPED(ptr)) {
+	if (size >= mmap_threshold)
+	    return map_realloc(ptr, size);
+    }
+    else if (ptr != NULL && size != 0 && SLAB_OWNS(ptr) && size <= SLAB_PAGE_OF(ptr)->osize)
+	return ptr;
+
+    a = ptr && !IS_MAPPED(ptr) ? ARENA_OF(ptr) : tcache_get()->arena;
+    ARENA_LOCK(a);
+    newp = heap_realloc(a, ptr, size);
+    ARENA_UNLOCK(a);
+    return newp;
+}
+
+/*
+ * Creates the key whose destructor flushes a thread's cache when the thread exits.
+ */
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+/*
+ * Returns the calling thread's cache, emptying it first if it belongs to an earlier
+ * heap. The objects in a stale cache are simply dropped; that heap is gone. A new cache
+ * is handed the next arena in round-robin order.
+ */
+static tcache_t *tcache_get(void)
+{
+    tcache_t *tc = &tcache;
+
+    if (tc->generation != heap_generation) {
+	memset(tc, 0, sizeof(*tc));
+	tc->generation = heap_generation;
+	tc->arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas];
+	pthread_once(&tcache_key_once, tcache_key_create);
+	pthread_setspecific(tcache_key, tc);
+    }
+    return tc;
+}
+
+/*
+ * Gives the first n objects of one class in a thread's cache back to their slab pages.
+ * Objects from the thread's own arena are freed under its lock, taken once; objects
+ * from other arenas go onto their remote-free stacks.
+ */
+static void tcache_release(tcache_t *tc, int cls, int n)
+{
+    arena_t *a;
+    char *bp;
+    int locked = 0;
+
+    for (; n > 0 && (bp = tc->head[cls]) != NULL; n--) {
+	tc->head[cls] = TCACHE_NEXT(bp);
+	tc->count[cls]--;
+	if ((a = ARENA_OF(bp)) != tc->arena) {
+	    remote_push(a, bp);
+	    continue;
+	}
+	if (!locked) {
+	    ARENA_LOCK(a);
+	    remote_drain(a);
+	    locked = 1;
+	}
+	slab_free(a, bp);
+    }
+    if (locked)
+	ARENA_UNLOCK(tc->arena);
+}
+
+/*
+ * Pushes a block onto an arena's remote-free stack. Many threads may push at once; the
+ * compare-and-swap retries until the block is linked in front of the current top.
+ */
+static void remote_push(arena_t *a, char *bp)
+{
+    char *top = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
+
+    do {
+	REMOTE_NEXT(bp) = top;
+    } while (!__atomic_compare_exchange_n(&a->remote_frees, &top, bp, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Frees every block on an arena's remote-free stack. The caller holds the arena's lock.
+ * The stack is taken whole in one exchange, so pushers are never held up and a block
+ * can never be popped twice.
+ */
+static void remote_drain(arena_t *a)
+{
+    char *bp, *next;
+
+    if (!__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED))
+	return;
+    for (bp = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE); bp; bp = next) {
+	next = REMOTE_NEXT(bp);
+	heap_free(a, bp);
+    }
+}
+
+/*
+ * Gives every object in a thread's cache back to the slab pages. Runs as the key
+ * destructor when a thread exits, so that its cached objects are not lost to the heap.
+ * Then drains every arena with blocks on its remote-free stack, as their owners may not
+ * call in again; among them are the blocks this thread just pushed.
+ */
+static void tcache_flush(void *arg)
+{
+    tcache_t *tc = arg;
+    arena_t *a;
+    int cls;
+
+    if (tc->generation != heap_generation)
+	return;
+
+    for (cls = 0; cls < SLAB_NUM_CLASSES; cls++)
+	tcache_release(tc, cls, tc->count[cls]);
+
+    for (a = arenas; a < arenas + num_arenas; a++) {
+	if (!__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED))
+	    continue;
+	ARENA_LOCK(a);
+	remote_drain(a);
+	ARENA_UNLOCK(a);
+    }
 }
-/* $end mminit */
 
 /* 
- * Allocates a DWORD-aligned block with a payload of at least the specified size.
- * First adjusts the size to ensure it is DWORD-aligned. Then searches free-lists for
+ * Allocates an ALIGNMENT-aligned block with a payload of at least the specified size.
+ * First adjusts the size to ensure it is ALIGNMENT-aligned. Then searches free-lists for
  * a fit. If it doesn't find a fit it extends the heap and finally allocates that
  * space.
  */
 /* $begin mmmalloc */
-void *mm_malloc(size_t size) {
+static void *heap_malloc(arena_t *a, size_t size) {
     size_t asize;      /* adjusted block size */
     size_t extendsize; /* amount to extend heap if no fit */
     char *bp;      
@@ -188,62 +818,96 @@ void *mm_malloc(size_t size) {
     if (size <= 0)
 	return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-	asize = DSIZE + OVERHEAD;
+    /* Small requests come from a slab page, and large ones get a mapping of their own */
+    if (size <= SLAB_MAX_SIZE)
+	return slab_malloc(a, size);
+    if (size >= mmap_threshold)
+	return map_malloc(size);
+
+    /* Adjust block size to include the header and alignment reqs. The block must
+       still be able to hold a footer and two links once it is freed. */
+    if (size <= SEG_MIN_BLOCK - ALLOC_OVERHEAD)
+	asize = SEG_MIN_BLOCK;
     else
-	asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+	asize = ALIGN(size + ALLOC_OVERHEAD);
     
     /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {
-	place(bp, asize);
-	return bp;
-    }
+    if ((bp = find_fit(a, asize)) != NULL)
+	return place(a, bp, asize, IS_PLACED_AT_END(asize));
 
     /* No fit found. Get more memory and place the block */
     extendsize = MAX(asize,CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL) {
+    if ((bp = extend_heap(a, extendsize/WSIZE)) == NULL) {
 	return NULL;
     }
-    place(bp, asize);
-
-    return bp;
+    return place(a, bp, asize, IS_PLACED_AT_END(asize));
 } 
 /* $end mmmalloc */
 
 /* 
- * Removes a block from memory. Sets header and footer to free to show block is free
- * and attempts to coalesce the newly freed blocks with surrounding free blocks if
- * any.
+ * Removes a block from memory. Sets header and footer to free to show block is free,
+ * tells the next block that its predecessor is now free, and attempts to coalesce the
+ * newly freed blocks with surrounding free blocks if any.
  */
 /* $begin mmfree */
-void mm_free(void *bp)
+static void heap_free(arena_t *a, void *bp)
 {
-    size_t size = GET_SIZE(HDRP(bp));
+    size_t size;
+
+    // a mapped block goes straight back to memlib.
+    if (IS_MAPPED(bp)) {
+	map_free(bp);
+	return;
+    }
 
-    PUT(HDRP(bp), PACK(size, 0));
+    // slab objects have no header; their page takes them back.
+    if (SLAB_OWNS(bp)) {
+	slab_free(a, bp);
+	return;
+    }
+
+    size = GET_SIZE(HDRP(bp));
+    PUT_KEEP_PREV(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
-    coalesce(bp);
+    CLEAR_PREV_ALLOC(NEXT_BLKP(bp));
+    bp = coalesce(a, bp);
+
+    // a big enough free block at the top of the heap goes mostly back to memlib.
+    if (GET_SIZE(HDRP(bp)) >= a->trim_threshold && NEXT_BLKP(bp) == a->chunk_end)
+	heap_trim(a, TRIM_PAD);
 }
 
 /* $end mmfree */
 
 /*
- * mm_realloc - uses 2 possible cases.
+ * heap_realloc - uses 4 possible cases.
  * 	case 1: if the new size will fit in what's availible already,
  * 	it simply stays in place.
  *      case 2: if there's a next free block and the combined storage
  *      is enough to store this block too, then coalesce with that block
  *      and store it here.
+ *      case 3: if there's a previous free block and it, this block and
+ *      the next block (when that is free too) are enough together, then
+ *      coalesce with them and slide the payload down with memmove.
+ *      case 4: if this block (with the next block, when that is free)
+ *      ends the arena's newest chunk, then extend the heap by just the
+ *      shortfall and grow into it.
  *      default: finds a different free block, copy the memory over,
  *      and free the current block
+ * A block that grows is tagged REGROWN. When a REGROWN block grows again, cases 2-4 and
+ * the default case give it up to REALLOC_ROOM bytes of slack, so a run of small grows
+ * mostly lands in case 1. Case 3 is only taken if it can give the full slack, since it
+ * copies the whole block. Case 1 keeps that slack while the block stays inside it, and
+ * gives it back when the block shrinks below that; mm_free gives it all back.
+ * Allocated blocks have no footer, so the in-place cases never mark the block free on
+ * the way through: a free footer would land on the last word of the payload.
  */
-void *mm_realloc(void *ptr, size_t size)
+static void *heap_realloc(arena_t *a, void *ptr, size_t size)
 {
     // special case: if null, simply perform a malloc.
     if(ptr == NULL) {
       void* newp;
-      if ((newp = mm_malloc(size)) == NULL) {
+      if ((newp = heap_malloc(a, size)) == NULL) {
 	  printf("ERROR: mm_malloc failed in mm_realloc\n");
 	  exit(1);
       }
@@ -252,86 +916,124 @@ void *mm_realloc(void *ptr, size_t size)
 
     // special case: if size is 0, simply free the memory.
     if(size == 0) {
-      mm_free(ptr);
+      heap_free(a, ptr);
       return 0;
     }
 
-    // adjusted size value which is 8-byte aligned and stores the overhead.
-    size_t asize;
+    // special case: a mapped block is remapped while it stays big enough for a mapping, and
+    // otherwise moves into the heap.
+    if(IS_MAPPED(ptr)) {
+      size_t osize = MAP_OF(ptr)->size - MAP_HDR_SIZE;
+      void* newp;
+
+      if(size >= mmap_threshold)
+	  return map_realloc(ptr, size);
+      if ((newp = heap_malloc(a, size)) == NULL) {
+	  printf("ERROR: mm_malloc failed in mm_realloc\n");
+	  exit(1);
+      }
+      memcpy(newp, ptr, MIN(size, osize));
+      map_free(ptr);
+      return newp;
+    }
 
-    // we need to keep track of these two spots, because we re-use some 
-    // functionality from coalescing, which assumes these spots are 
-    // free to modify. So, these get saved and restored later.
-    size_t firstWord = GET_NEXT_FREE(ptr);
-    size_t secondWord = GET_PREV_FREE(ptr);
+    // special case: a slab object stays put while the new size still fits its slot, and
+    // otherwise moves to wherever heap_malloc puts a block of the new size.
+    if(SLAB_OWNS(ptr)) {
+      size_t osize = SLAB_PAGE_OF(ptr)->osize;
+      void* newp;
+
+      if(size <= osize)
+	  return ptr;
+      if ((newp = heap_malloc(a, size)) == NULL) {
+	  printf("ERROR: mm_malloc failed in mm_realloc\n");
+	  exit(1);
+      }
+      memcpy(newp, ptr, osize);
+      slab_free(a, ptr);
+      return newp;
+    }
+
+    // adjusted size value which is ALIGNMENT-aligned and stores the overhead, and the
+    // size with headroom that a growing block gets where there is room for it.
+    size_t asize, target;
 
     // some information necessary for the various conditions.
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(ptr));
     size_t thisBlockSize = GET_SIZE(HDRP(ptr));
     size_t nextBlockSize =  GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+    size_t have = thisBlockSize + (next_alloc ? 0 : nextBlockSize);
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-	asize = DSIZE + OVERHEAD;
+    /* Adjust block size to include the header and alignment reqs. The block must
+       still be able to hold a footer and two links once it is freed. */
+    if (size <= SEG_MIN_BLOCK - ALLOC_OVERHEAD)
+	asize = SEG_MIN_BLOCK;
     else
-	asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
-
-    // case 1: just use the in-place memory.
-    if(thisBlockSize >= asize + OVERHEAD) {
-
-	// mark the memory as free so it can be managed by the place() function
-	size_t duringCoalesceSize = GET_SIZE(HDRP(ptr));
-	PUT(HDRP(ptr), PACK(duringCoalesceSize, 0));
-	PUT(FTRP(ptr), PACK(duringCoalesceSize, 0));
-
-	// re-used from coalesce, this will get the memory split if necessary.
-	insertFreeBlockAtBeginning(ptr);
-	place(ptr, asize + OVERHEAD);
-
-	// re-substitute the memory that was at the next and prev locations.
-	SET_NEXT_FREE(ptr, firstWord);
-	SET_PREV_FREE(ptr, secondWord);
-
+	asize = ALIGN(size + ALLOC_OVERHEAD);
+    target = IS_REGROWN(ptr) ? asize + REALLOC_ROOM(asize) : asize;
+
+    // case 1: just use the in-place memory, giving back any tail that is big enough
+    // unless it is headroom that the block is still within.
+    if(thisBlockSize >= asize) {
+	if (thisBlockSize > target)
+	    trim_block(a, ptr, thisBlockSize, asize);
 	return ptr;
     }
     else if (!next_alloc && (thisBlockSize + nextBlockSize >= asize)) {            /* Case 2 */
 
-	// mark the memory as free so it can be managed by the place() function
-	size_t duringCoalesceSize = GET_SIZE(HDRP(ptr));
-	PUT(HDRP(ptr), PACK(duringCoalesceSize, 0));
-	PUT(FTRP(ptr), PACK(duringCoalesceSize, 0));
-
-	thisBlockSize += nextBlockSize;
-
-	// re-used from coalesce, this will get the memory coalesced and split.
-	dissociateBlockFromList(NEXT_BLKP(ptr));
-	insertFreeBlockAtBeginning(ptr);
-
-	// update the size of the block and set it to free.
-	PUT(HDRP(ptr), PACK(thisBlockSize, 0));
-	PUT(FTRP(ptr), PACK(thisBlockSize, 0));
-
-	place(ptr, asize);
-
-	// re-substitute the memory that was at the next and prev locations.
-	SET_NEXT_FREE(ptr, firstWord);
-	SET_PREV_FREE(ptr, secondWord);
-
+	// the next block is absorbed, and whatever is left over goes back to a free-list.
+	dissociateBlockFromList(a, NEXT_BLKP(ptr));
+	trim_block(a, ptr, thisBlockSize + nextBlockSize, MIN(target, thisBlockSize + nextBlockSize));
+	SET_REGROWN(ptr);
 	return ptr;
     }
+    else if (!prev_alloc && GET_SIZE(HDRP(PREV_BLKP(ptr))) + have >= target) {     /* Case 3 */
+	char *prevp = PREV_BLKP(ptr);
+
+	// the neighbors leave the free-lists before the payload slides over the links
+	// of the previous block; the old payload is all copied since the block grows.
+	dissociateBlockFromList(a, prevp);
+	if (!next_alloc)
+	    dissociateBlockFromList(a, NEXT_BLKP(ptr));
+	memmove(prevp, ptr, thisBlockSize - ALLOC_OVERHEAD);
+	trim_block(a, prevp, GET_SIZE(HDRP(prevp)) + have, MIN(target, GET_SIZE(HDRP(prevp)) + have));
+	SET_REGROWN(prevp);
+	return prevp;
+    }
+    else if ((char *)ptr + have == a->chunk_end) {                                 /* Case 4 */
+
+	// the new memory coalesces with the next block if it is free; should another arena
+	// have taken the memory after the chunk, it is a new chunk and the default case
+	// below finds it.
+	if (extend_heap(a, (target - have) / WSIZE) == NULL) {
+	    printf("ERROR: mm_malloc failed in mm_realloc\n");
+	    exit(1);
+	}
+	if (!GET_ALLOC(HDRP(NEXT_BLKP(ptr))) &&
+	    thisBlockSize + (nextBlockSize = GET_SIZE(HDRP(NEXT_BLKP(ptr)))) >= asize) {
+	    dissociateBlockFromList(a, NEXT_BLKP(ptr));
+	    trim_block(a, ptr, thisBlockSize + nextBlockSize, MIN(target, thisBlockSize + nextBlockSize));
+	    SET_REGROWN(ptr);
+	    return ptr;
+	}
+    }
 
 
     // default case: the naive realloc implementation.
     void *newp;
     size_t copySize;
 
-    // allocate new memory spot.
-    if ((newp = mm_malloc(size)) == NULL) {
+    // allocate new memory spot, with the headroom; only a heap block has a header to tag.
+    if ((newp = heap_malloc(a, size + (target - asize))) == NULL) {
 	printf("ERROR: mm_malloc failed in mm_realloc\n");
 	exit(1);
     }
+    if (!IS_MAPPED(newp) && !SLAB_OWNS(newp))
+	SET_REGROWN(newp);
 
-    copySize = GET_SIZE(HDRP(ptr));
+    // only the payload is copied; the header is not part of it.
+    copySize = GET_SIZE(HDRP(ptr)) - ALLOC_OVERHEAD;
     if (size < copySize) {
 	copySize = size;
     }
@@ -339,77 +1041,234 @@ void *mm_realloc(void *ptr, size_t size)
     // move the memory over
     memcpy(newp, ptr, copySize);
 
-    mm_free(ptr);
+    heap_free(a, ptr);
     return newp;
 }
 
-/* 
- * Checks the heap to determine if headers and footers are consistent
- * and to see if blocks overlap. runs through both free-lists. Also 
- * checks prologue header and footer as well as the epilogue header.
+/*
+ * Gives a request of size bytes a mapping of its own from memlib: a map_t, the block's
+ * header (tagged MAPPED and holding the offset back to the map_t) and the payload, all
+ * rounded up to whole pages. Such a block never touches the free-lists, so freeing it
+ * cannot leave a hole in the heap.
  */
-void mm_checkheap(int verbose) 
+static void *map_malloc(size_t size)
 {
+    size_t msize = MAP_SIZE(size);
+    map_t *m;
+    char *bp;
 
-    printf("\n\n\nprinting the heap:\n");
+    if ((m = mem_map(msize)) == NULL)
+	return NULL;
+    m->size = msize;
+
+    // push it onto map_list.
+    MAP_LOCK();
+    m->prev = NULL;
+    m->next = map_list;
+    if (map_list)
+	map_list->prev = m;
+    map_list = m;
+    MAP_UNLOCK();
+
+    bp = (char *)m + MAP_HDR_SIZE;
+    PUT(HDRP(bp), PACK(MAP_HDR_SIZE, 1) | MAPPED);
+    return bp;
+}
+
+/*
+ * Takes a mapped block off map_list and gives its mapping back to memlib.
+ */
+static void map_free(void *bp)
+{
+    map_t *m = MAP_OF(bp);
+
+    MAP_LOCK();
+    if (m->prev)
+	m->prev->next = m->next;
+    else
+	map_list = m->next;
+    if (m->next)
+	m->next->prev = m->prev;
+    MAP_UNLOCK();
 
-    // SMALL LIST
+    mem_unmap(m, m->size);
+}
+
+/*
+ * Resizes a mapped block to hold size bytes by resizing its mapping, which grows in place
+ * when the pages after it are free and otherwise is moved by the system without copying
+ * through the allocator. map_list is locked throughout, since the links of its neighbours
+ * have to follow it if it moves.
+ */
+static void *map_realloc(void *bp, size_t size)
+{
+    size_t msize = MAP_SIZE(size);
+    map_t *m = MAP_OF(bp), *newm;
+
+    if (msize == m->size)
+	return bp;
+
+    MAP_LOCK();
+    if ((newm = mem_remap(m, m->size, msize)) != NULL) {
+	newm->size = msize;
+	if (newm->prev)
+	    newm->prev->next = newm;
+	else
+	    map_list = newm;
+	if (newm->next)
+	    newm->next->prev = newm;
+    }
+    MAP_UNLOCK();
+
+    return newm ? (char *)newm + MAP_HDR_SIZE : NULL;
+}
+
+/*
+ * Checks one arena's size classes and slab classes: every list agrees
+ * with the bitmap, holds only blocks of its class, and holds only blocks
+ * the arena owns.
+ */
+static void checkarena(arena_t *a, int verbose)
+{
+    char *bp;
+    int cls;
+
+    // SEGREGATED LISTS
     // ------
     //
-    char *bp = free_list_small_root_p;
+    for (cls = 0; cls < SEG_NUM_CLASSES; cls++) {
 
-    // print the head information.
-    if (verbose)
-	condprintf("\tfree_list_small_root_p (%p):\n", free_list_small_root_p);
+	// the bitmap must agree with whether the list is empty.
+	if (!a->seg_roots[cls] != !(a->seg_bitmap & (1u << cls)))
+	    printf("Error: bitmap bit %d does not match seg_roots[%d]\n", cls, cls);
 
-    // Iterate across the list and verify that each block is valid.
-    for (bp = free_list_small_root_p; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
-	if (verbose) 
-	    condPrintblockExtra(bp);
-	checkblock(bp);
+	if (!a->seg_roots[cls])
+	    continue;
+
+	// the tree has its own walk.
+	if (cls == SEG_TREE_CLASS) {
+	    if (verbose)
+		condprintf("\ttree root (%p):\n", a->seg_roots[cls]);
+	    checktree(a->seg_roots[cls], verbose);
+	    continue;
+	}
+
+	// print the head information.
+	if (verbose)
+	    condprintf("\tseg_roots[%d] (%p):\n", cls, a->seg_roots[cls]);
+
+	// Iterate across the list and verify that each block is valid and in the right class.
+	for (bp = a->seg_roots[cls]; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
+	    if (verbose) 
+		condPrintblockExtra(bp);
+	    checkblock(bp);
+	    if (seg_class(GET_SIZE(HDRP(bp))) != cls)
+		printf("Error: %p is in size class %d but belongs in %d\n",
+		       bp, cls, seg_class(GET_SIZE(HDRP(bp))));
+	    if (ARENA_OF(bp) != a)
+		printf("Error: %p is on a list of arena %d\n", bp, (int)(a - arenas));
+	}
     }
 
-    // LARGE LIST
+    // SLAB PAGES
     // ------
     //
-    bp = free_list_large_root_p;
+    for (cls = 0; cls < SLAB_NUM_CLASSES; cls++) {
+	slab_t *sp;
+	int w, nfree = 0;
+
+	// every page on a class list has room and agrees with its own bookkeeping.
+	for (sp = a->slab_heads[cls]; sp != NULL; sp = (slab_t *)LINK_DECODE(sp->next)) {
+	    if (verbose)
+		condprintf("\tslab class %d page %p: %d of %d used, %d carved\n",
+			   cls, sp, sp->nused, sp->cap, sp->bump);
+	    if (!SLAB_OWNS(sp) || SLAB_PAGE_OF(sp) != sp)
+		printf("Error: slab page %p is not in the page map\n", sp);
+	    if (sp->osize != SLAB_OSIZE(cls) || sp->nused >= sp->cap)
+		printf("Error: slab page %p does not belong on list %d\n", sp, cls);
+	    for (w = 0, nfree = 0; w < SLAB_MAP_WORDS; w++)
+		nfree += __builtin_popcount(sp->freemap[w]);
+	    if (nfree != sp->bump - sp->nused)
+		printf("Error: slab page %p has %d free bits for %d free objects\n",
+		       sp, nfree, sp->bump - sp->nused);
+	    if (ARENA_OF(sp) != a)
+		printf("Error: slab page %p is on a list of arena %d\n", sp, (int)(a - arenas));
+	}
+    }
+}
 
+/* 
+ * Checks the heap to determine if headers and footers are consistent
+ * and to see if blocks overlap. runs through every size class list and
+ * checks it against the occupancy bitmap. Also checks prologue header
+ * and footer as well as the epilogue header.
+ */
+void mm_checkheap(int verbose) 
+{
 
-    // print the head information.
-    if (verbose)
-	condprintf("\tfree_list_large_root_p (%p):\n", free_list_large_root_p);
+    printf("\n\n\nprinting the heap:\n");
 
-    // Iterate across the list and verify that each block is valid.
-    for (bp = free_list_large_root_p; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
-	if (verbose) 
-	    condPrintblockExtra(bp);
-	checkblock(bp);
+    char *bp, *chunk;
+    arena_t *a;
+    map_t *m;
+
+    for (a = arenas; a < arenas + num_arenas; a++) {
+	if (verbose && num_arenas > 1)
+	    condprintf("arena %d:\n", (int)(a - arenas));
+	checkarena(a, verbose);
     }
 
-    // ENTIRE THING
-    bp = (char*) heap_listp;
 
-    // print the head information.
-    if (verbose)
-	printf("Heap (%p):\n", heap_listp);
+    // ENTIRE THING, one chunk at a time. Each chunk ends where the next one starts.
+    for (chunk = heap_base; chunk < (char *)mem_heap_hi(); chunk = bp) {
+	a = ARENA_OF(chunk);
+	bp = chunk + ALIGNMENT;
 
-    // verify that the header works.
-    if ((GET_SIZE(HDRP(heap_listp)) != DSIZE) || !GET_ALLOC(HDRP(heap_listp)))
-	printf("Bad prologue header\n");
-    checkblock(heap_listp);
+	// print the head information.
+	if (verbose)
+	    printf("Chunk (%p) of arena %d:\n", chunk, (int)(a - arenas));
 
-    // iterate over every block in the heap until the end, check the blocks.
-    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-	if (verbose) 
-	    condPrintblockExtra(bp);
+	// verify that the header works.
+	if ((GET_SIZE(HDRP(bp)) != ALIGNMENT) || !GET_ALLOC(HDRP(bp)))
+	    printf("Bad prologue header\n");
 	checkblock(bp);
-    }
+
+	// iterate over every block in the chunk until its end, check the blocks.
+	for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+	    if (verbose) 
+		condPrintblockExtra(bp);
+	    checkblock(bp);
+	    if (ARENA_OF(bp) != a)
+		printf("Error: %p is in a chunk of arena %d\n", bp, (int)(a - arenas));
+
+	    // the next header's prev-alloc bit must agree with this block.
+	    if (!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp)))
+		printf("Error: prev-alloc bit of %p does not match %p\n", NEXT_BLKP(bp), bp);
+	    if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+		printf("Error: free blocks %p and %p were not coalesced\n", bp, NEXT_BLKP(bp));
+	}
      
-    // check the epilogue header
-    if (verbose)
-	condPrintblockExtra(bp);
-    if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
-	printf("Bad epilogue header\n");
+	// check the epilogue header
+	if (verbose)
+	    condPrintblockExtra(bp);
+	if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
+	    printf("Bad epilogue header\n");
+    }
+
+    // MAPPED BLOCKS
+    // ------
+    //
+    for (m = map_list; m != NULL; m = m->next) {
+	bp = (char *)m + MAP_HDR_SIZE;
+	if (verbose)
+	    condprintf("\tmapping %p: %zu bytes\n", m, m->size);
+	if (!(GET(HDRP(bp)) & MAPPED) || !GET_ALLOC(HDRP(bp)) || MAP_OF(bp) != m)
+	    printf("Error: mapped block %p has a bad header\n", bp);
+	if (!IS_MAPPED(bp) || m->size % mem_pagesize())
+	    printf("Error: mapping %p is not whole pages outside the heap\n", m);
+	if (m->next && m->next->prev != m)
+	    printf("Error: map_list is broken after %p\n", m);
+    }
 
 }
 
@@ -420,183 +1279,517 @@ void mm_checkheap(int verbose)
  * and returns its block pointer.
  */
 /* $begin mmextendheap */
-static void *extend_heap(size_t words) 
+static void *extend_heap(arena_t *a, size_t words) 
 {
     char *bp;
-    size_t size;
+    size_t size, i;
+    int fresh;
 	
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
-    if ((bp = mem_sbrk(size)) == (void *)-1) 
+    /* Round up to a whole number of ALIGNMENT units to maintain alignment, and to at
+       least a block that can be free, since the new memory becomes one. A new chunk
+       also needs room for its padding and prologue, unless this arena is alone and so
+       always grows in place; with several arenas each takes whole ARENA_GRANULEs. */
+    size = MAX(ALIGN(words * WSIZE), SEG_MIN_BLOCK);
+    if (num_arenas > 1 || !a->chunk_end)
+	size += 2*ALIGNMENT;
+    if (num_arenas > 1)
+	size = (size + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+    /* Growing right after a trim means the trim gave back memory that was still needed,
+       so mm_free waits for a bigger free block before it trims again. */
+    if (a->trimmed) {
+	a->trim_threshold = MAX(2*a->trim_threshold, size);
+	a->trimmed = 0;
+    }
+
+    BRK_LOCK();
+    bp = mem_sbrk(size);
+    BRK_UNLOCK();
+    if (bp == (void *)-1) 
 	return NULL;
 
-    /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));         /* free block header */
-    PUT(FTRP(bp), PACK(size, 0));         /* free block footer */
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+    // the new memory belongs to this arena and holds no slab pages yet.
+    for (i = (bp - heap_base) / ARENA_GRANULE; i <= (bp + size - 1 - heap_base) / ARENA_GRANULE; i++)
+	arena_map[i] = a - arenas;
+    for (i = (bp - heap_base + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+	 i * SLAB_PAGE_SIZE < (size_t)(bp + size - heap_base); i++)
+	SLAB_PAGEMAP_CLEAR(i);
+
+    /* If another arena took the memory after our newest chunk, start a new chunk: the
+       prologue is one ALIGNMENT-sized block placed so that the first real payload lands
+       on an ALIGNMENT boundary. */
+    fresh = bp != a->chunk_end;
+    a->chunk_end = bp + size;
+    if (fresh) {
+	memset(bp, 0, ALIGNMENT - WSIZE);                                   /* alignment padding */
+	PUT(bp + ALIGNMENT - WSIZE, PACK(ALIGNMENT, 1) | PREV_ALLOC);       /* prologue header */
+	PUT(bp + 2*ALIGNMENT - DSIZE, PACK(ALIGNMENT, 1));                  /* prologue footer */
+	bp += 2*ALIGNMENT;
+	size -= 2*ALIGNMENT;
+	PUT(HDRP(bp), PACK(size, 0) | PREV_ALLOC); /* free block header */
+    } else {
+	/* The old epilogue header becomes the new block's header and already knows about
+	   the block before. */
+	PUT_KEEP_PREV(HDRP(bp), PACK(size, 0)); /* free block header */
+    }
+    PUT(FTRP(bp), PACK(size, 0));           /* free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* new epilogue header */
 
     /* Coalesce if the previous block was free */
-    return coalesce(bp);
+    return coalesce(a, bp);
+}
+
+/*
+ * Gives back to memlib all but pad bytes of the free block at the top of the heap, if
+ * this arena's newest chunk is what ends at the break. The block shrinks (or vanishes,
+ * leaving its header as the new epilogue) and the break moves down by whole ALIGNMENT
+ * units, or whole ARENA_GRANULEs when there are several arenas. Returns 1 if it released
+ * anything.
+ */
+static int heap_trim(arena_t *a, size_t pad)
+{
+    char *bp;
+    size_t size, step, release = 0;
+
+    BRK_LOCK();
+    if (a->chunk_end && a->chunk_end == (char *)mem_heap_hi() + 1 &&
+	!GET_PREV_ALLOC(HDRP(a->chunk_end))) {
+
+	// the block before the epilogue is free, so its footer gives us its size.
+	bp = PREV_BLKP(a->chunk_end);
+	size = GET_SIZE(HDRP(bp));
+	step = num_arenas > 1 ? ARENA_GRANULE : ALIGNMENT;
+	if (size > pad)
+	    release = (size - pad) / step * step;
+
+	// whatever is left must still be a whole free block.
+	if (release < size && size - release < SEG_MIN_BLOCK)
+	    release = release > step ? release - step : 0;
+
+	if (release > 0 && mem_sbrk(-(intptr_t)release) != (void *)-1) {
+	    dissociateBlockFromList(a, bp);
+	    size -= release;
+	    if (size > 0) {
+		PUT_KEEP_PREV(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+		PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
+		insertFreeBlockAtBeginning(a, bp);
+	    } else {
+		PUT_KEEP_PREV(HDRP(bp), PACK(0, 1));  /* new epilogue header */
+	    }
+	    a->chunk_end -= release;
+	    a->trimmed = 1;
+	} else {
+	    release = 0;
+	}
+    }
+    BRK_UNLOCK();
+    return release > 0;
 }
 /* $end mmextendheap */
 
 /* 
- * Allocates a block at the specified free block. If there is a remainder
- * it pushes the free block pointers to what is still free. Otherwise just
- * dissociates the free block from the list.
+ * Allocates a block at the specified free block and returns its block pointer. The
+ * block always leaves its size class; if there is a remainder, it becomes a new free
+ * block and goes into the class for its own size. When from_end is set, the allocated
+ * block is carved from the high end of the free block instead of the low end.
  */
 /* $begin mmplace */
 /* $begin mmplace-proto */
-static void place(void *bp, size_t asize)
+static void *place(arena_t *a, void *bp, size_t asize, int from_end)
 /* $end mmplace-proto */
 {
     size_t csize = GET_SIZE(HDRP(bp));   
 
+    // the block is no longer free, whether or not it gets split.
+    dissociateBlockFromList(a, bp);
+
     // can we fit this block here WITH leftover free space?
-    if ((csize - asize) >= (DSIZE + OVERHEAD)) { 
+    if ((csize - asize) >= SEG_MIN_BLOCK) { 
+
+	// the free remainder stays at the front and the new block goes after it.
+	if (from_end) {
+	    PUT_KEEP_PREV(HDRP(bp), PACK(csize-asize, 0));
+	    PUT(FTRP(bp), PACK(csize-asize, 0));
+	    PUT(HDRP(NEXT_BLKP(bp)), PACK(asize, 1));
+	    SET_PREV_ALLOC(NEXT_BLKP(NEXT_BLKP(bp)));
+	    insertFreeBlockAtBeginning(a, bp);
+	    return NEXT_BLKP(bp);
+	}
 
-	// information about the block.
-	char* prevThing = (char*)GET_PREV_FREE(bp);
-	char* nextThing = (char*)GET_NEXT_FREE(bp);
+	// adjusting the size/alloc flags of the blocks.
+	PUT_KEEP_PREV(HDRP(bp), PACK(asize, 1));
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(csize-asize, 0) | PREV_ALLOC);
+	PUT(FTRP(NEXT_BLKP(bp)), PACK(csize-asize, 0));
 
-	// the new location of the free block after what's being placed.
-	void* adjustedBp = (void*)(bp + asize);
+	// the remainder is smaller, so it usually lands in a lower class.
+	insertFreeBlockAtBeginning(a, NEXT_BLKP(bp));
+    }
+    else { 
 
-	// case 1
-	// (root)Y - Z? -> shifted (root)Y - Z?
-	// case 2
-	// X - Y - Z? -> X - shifted Y - Z?
-	
-	// case 1 specific
-	if(!prevThing) {
-	    if(IS_IN_SMALL_REGION(bp)) {
-	      free_list_small_root_p = adjustedBp;
-	    } else {
-	      free_list_large_root_p = adjustedBp;
-	    }
-	}
+	// set the new alloc flags of this block.
+	PUT_KEEP_PREV(HDRP(bp), PACK(csize, 1));
+	SET_PREV_ALLOC(NEXT_BLKP(bp));
+    }
+    return bp;
+}
+/* $end mmplace */
 
-	// case 2 specific
-	if(prevThing) {
-	    SET_NEXT_FREE(prevThing, adjustedBp);
-	}
+/*
+ * Turns the allocated block at bp, currently csize bytes, into one of asize bytes. If the
+ * tail left over is big enough to be a block, it is freed and coalesced with whatever
+ * follows it; otherwise the whole csize bytes stay allocated. Used by mm_realloc.
+ */
+static void trim_block(arena_t *a, void *bp, size_t csize, size_t asize)
+{
+    char *rest;
 
-	// both case 1 and 2, setting the list links and handling if there's a next (Z)
-	SET_NEXT_FREE(adjustedBp, nextThing);
-	SET_PREV_FREE(adjustedBp, prevThing);
-	if(nextThing) {
-	    SET_PREV_FREE(nextThing, adjustedBp);
-	}
+    if ((csize - asize) >= SEG_MIN_BLOCK) {
+	PUT_KEEP_PREV(HDRP(bp), PACK(asize, 1));
 
-	// adjusting the size/alloc flags of the blocks.
-	PUT(HDRP(bp), PACK(asize, 1));
-	PUT(FTRP(bp), PACK(asize, 1));
-	bp = NEXT_BLKP(bp);
-	PUT(HDRP(bp), PACK(csize-asize, 0));
-	PUT(FTRP(bp), PACK(csize-asize, 0));
+	// the tail becomes a free block, and the block after it must know that.
+	rest = NEXT_BLKP(bp);
+	PUT(HDRP(rest), PACK(csize-asize, 0) | PREV_ALLOC);
+	PUT(FTRP(rest), PACK(csize-asize, 0));
+	CLEAR_PREV_ALLOC(NEXT_BLKP(rest));
+	coalesce(a, rest);
     }
-    else { 
+    else {
+	PUT_KEEP_PREV(HDRP(bp), PACK(csize, 1));
+	SET_PREV_ALLOC(NEXT_BLKP(bp));
+    }
+}
+
+/*
+ * Allocates an object from a slab page of the request's class. A freed object is reused
+ * if the page has one; otherwise the next never-used object is bumped off the end of the
+ * page. If no page of the class has room, a new one is made first.
+ */
+static void *slab_malloc(arena_t *a, size_t size)
+{
+    int cls = SLAB_CLASS(size);
+    slab_t *s = a->slab_heads[cls];
+    int idx, w;
 
-	// link the things on the left and right.
-	dissociateBlockFromList(bp);
+    if (!s && (s = slab_page_new(a, cls)) == NULL)
+	return NULL;
 
-	// set the new alloc flags of this block.
-	PUT(HDRP(bp), PACK(csize, 1));
-	PUT(FTRP(bp), PACK(csize, 1));
+    // every object below bump that is not in use has its bit set in freemap.
+    if (s->nused < s->bump) {
+	for (w = 0; !s->freemap[w]; w++)
+	    ;
+	idx = w * 32 + __builtin_ctz(s->freemap[w]);
+	s->freemap[w] &= ~(1u << (idx % 32));
     }
+    else {
+	idx = s->bump++;
+    }
+
+    // a full page leaves the list until one of its objects is freed.
+    if (++s->nused == s->cap)
+	slab_list_remove(a, s, cls);
+
+    return (char *)s + SLAB_HDR_SIZE + idx * s->osize;
 }
-/* $end mmplace */
 
-/* 
- * Finds a fit for a new block. If it is small, first checks the small list. Then both
- * small and large blocks check the large list. If there are no free blocks large enough,
- * returns NULL to show need for extending the heap.
+/*
+ * Returns an object to its slab page. A page that was full goes back on its class list,
+ * and a page that is now empty is given back to the heap, unless it is the last page
+ * on the list; keeping that one avoids making and releasing a page over and over when
+ * a single object is allocated and freed in a loop.
  */
-void *find_fit(size_t asize)
+static void slab_free(arena_t *a, void *bp)
 {
-    char *bp;
+    slab_t *s = SLAB_PAGE_OF(bp);
+    int cls = SLAB_CLASS(s->osize);
+    int idx = ((char *)bp - (char *)s - SLAB_HDR_SIZE) / s->osize;
+
+    s->freemap[idx / 32] |= 1u << (idx % 32);
+
+    if (s->nused-- == s->cap) {
+	s->prev = 0;
+	s->next = LINK_ENCODE(a->slab_heads[cls]);
+	if (a->slab_heads[cls])
+	    a->slab_heads[cls]->prev = LINK_ENCODE(s);
+	a->slab_heads[cls] = s;
+    }
 
-    // iterate across the free list, find a spot that is big enough, and use this.
-    if(IS_SMALL(asize)) {
-      for(bp = free_list_small_root_p; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
-	  if(asize <= GET_SIZE(HDRP(bp))) {
-	      return bp;
-	  }
-      }
+    if (s->nused == 0 && (a->slab_heads[cls] != s || s->next))
+	slab_page_release(a, s, cls);
+}
+
+/*
+ * Makes a new slab page for class cls and puts it on the class list. The page is an
+ * allocated block whose payload starts on a SLAB_PAGE_SIZE boundary (counted from the
+ * start of the heap), so any object's page is found by rounding its address down. The
+ * free block it is cut from is asked to be big enough that there is always such a
+ * boundary with either nothing or a whole free block in front of it; the pieces in
+ * front and behind go back to the free-lists.
+ */
+static slab_t *slab_page_new(arena_t *a, int cls)
+{
+    size_t asize = 2*SLAB_PAGE_SIZE + SEG_MIN_BLOCK;
+    size_t csize, gap, rest, psize, i;
+    char *bp, *page;
+    slab_t *s;
+
+    if ((bp = find_fit(a, asize)) == NULL &&
+	(bp = extend_heap(a, MAX(asize, CHUNKSIZE)/WSIZE)) == NULL)
+	return NULL;
+    csize = GET_SIZE(HDRP(bp));
+    dissociateBlockFromList(a, bp);
+
+    // distance to the next page boundary, skipping one that would leave too small a gap.
+    gap = (SLAB_PAGE_SIZE - (size_t)(bp - heap_base) % SLAB_PAGE_SIZE) % SLAB_PAGE_SIZE;
+    if (gap && gap < SEG_MIN_BLOCK)
+	gap += SLAB_PAGE_SIZE;
+    page = bp + gap;
+
+    // a tail too small to be a block of its own stays with the page.
+    rest = csize - gap - SLAB_PAGE_SIZE;
+    psize = (rest >= SEG_MIN_BLOCK) ? SLAB_PAGE_SIZE : SLAB_PAGE_SIZE + rest;
+
+    if (gap) {
+	PUT_KEEP_PREV(HDRP(bp), PACK(gap, 0));
+	PUT(FTRP(bp), PACK(gap, 0));
+	insertFreeBlockAtBeginning(a, bp);
+	PUT(HDRP(page), PACK(psize, 1));
+    }
+    else {
+	PUT_KEEP_PREV(HDRP(page), PACK(psize, 1));
+    }
+
+    if (psize == SLAB_PAGE_SIZE) {
+	PUT(HDRP(NEXT_BLKP(page)), PACK(rest, 0) | PREV_ALLOC);
+	PUT(FTRP(NEXT_BLKP(page)), PACK(rest, 0));
+	insertFreeBlockAtBeginning(a, NEXT_BLKP(page));
+    }
+    else {
+	SET_PREV_ALLOC(NEXT_BLKP(page));
     }
 
-    // fallthrough to the larger freelist.
-    for(bp = free_list_large_root_p; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
-	if(asize <= GET_SIZE(HDRP(bp))) {
-	    return bp;
+    // only objects inside the first SLAB_PAGE_SIZE bytes can be traced back to the page.
+    s = (slab_t *)page;
+    s->osize = SLAB_OSIZE(cls);
+    s->cap = (SLAB_PAGE_SIZE - ALLOC_OVERHEAD - SLAB_HDR_SIZE) / s->osize;
+    s->nused = 0;
+    s->bump = 0;
+    memset(s->freemap, 0, sizeof(s->freemap));
+
+    s->prev = 0;
+    s->next = LINK_ENCODE(a->slab_heads[cls]);
+    if (a->slab_heads[cls])
+	a->slab_heads[cls]->prev = LINK_ENCODE(s);
+    a->slab_heads[cls] = s;
+
+    i = SLAB_PAGE_INDEX(page);
+    SLAB_PAGEMAP_SET(i);
+    return s;
+}
+
+/*
+ * Takes an empty slab page off its class list and out of the page map, and frees it
+ * as an ordinary block so it coalesces with its neighbours.
+ */
+static void slab_page_release(arena_t *a, slab_t *s, int cls)
+{
+    size_t i = SLAB_PAGE_INDEX(s);
+
+    slab_list_remove(a, s, cls);
+    SLAB_PAGEMAP_CLEAR(i);
+    heap_free(a, s);
+}
+
+/*
+ * Unlinks a slab page from the list of pages of its class that have a free object.
+ */
+static void slab_list_remove(arena_t *a, slab_t *s, int cls)
+{
+    slab_t *prev = (slab_t *)LINK_DECODE(s->prev);
+    slab_t *next = (slab_t *)LINK_DECODE(s->next);
+
+    if (prev)
+	prev->next = s->next;
+    else
+	a->slab_heads[cls] = next;
+    if (next)
+	next->prev = s->prev;
+}
+
+/*
+ * Maps a block size to its size class. Sizes up to SEG_LINEAR_MAX get one class
+ * per SEG_LINEAR_STEP; above that each class covers (SEG_LINEAR_MAX*2^k, SEG_LINEAR_MAX*2^(k+1)],
+ * and the last class (the tree) takes everything that is left.
+ */
+static int seg_class(size_t size)
+{
+    int cls;
+
+    if (size <= SEG_LINEAR_MAX)
+	return (size - SEG_MIN_BLOCK) / SEG_LINEAR_STEP;
+
+    // floor(log2((size-1) / SEG_LINEAR_MAX)) picks the power-of-two range.
+    cls = SEG_LINEAR_CLASSES + (31 - __builtin_clz((size - 1) / SEG_LINEAR_MAX));
+    return (cls < SEG_NUM_CLASSES) ? cls : SEG_NUM_CLASSES - 1;
+}
+
+/*
+ * Searches one size class list according to the placement policy. If any_fits is set,
+ * every block in the list is known to be big enough, so first-fit can take the head.
+ *   first-fit: the first block that fits.
+ *   next-fit:  the first block that fits, starting where the last search of this class
+ *              stopped and wrapping around to the head.
+ *   best-fit:  the smallest block among the first fit_max_candidates blocks that fit.
+ *   exact-fit: a block of exactly asize if there is one, otherwise the first that fits.
+ * The tree class always returns the best fit, whatever the policy.
+ */
+static void *search_class(arena_t *a, int cls, size_t asize, int any_fits)
+{
+    char *bp;
+    char *start;
+    char *best = NULL;
+    size_t bsize;
+    int candidates = 0;
+
+    if (cls == SEG_TREE_CLASS)
+	return tree_find_fit(a, asize);
+
+    switch (fit_policy) {
+
+    case MM_FIT_NEXT:
+	// walk from the rover to the end of the list, then from the head to the rover.
+	start = a->seg_rovers[cls] ? a->seg_rovers[cls] : a->seg_roots[cls];
+	for (bp = start; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
+	    if (asize <= GET_SIZE(HDRP(bp)))
+		return a->seg_rovers[cls] = bp;
+	}
+	for (bp = a->seg_roots[cls]; bp != start; bp = (char*)GET_NEXT_FREE(bp)) {
+	    if (asize <= GET_SIZE(HDRP(bp)))
+		return a->seg_rovers[cls] = bp;
+	}
+	return NULL;
+
+    case MM_FIT_BEST:
+	// an exact fit ends the scan early, otherwise stop after enough candidates.
+	for (bp = a->seg_roots[cls]; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
+	    bsize = GET_SIZE(HDRP(bp));
+	    if (asize == bsize)
+		return bp;
+	    if (asize < bsize) {
+		if (!best || bsize < GET_SIZE(HDRP(best)))
+		    best = bp;
+		if (++candidates >= fit_max_candidates)
+		    break;
+	    }
 	}
+	return best;
+
+    case MM_FIT_EXACT:
+	// remember the first fit in case there is no exact one.
+	for (bp = a->seg_roots[cls]; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
+	    bsize = GET_SIZE(HDRP(bp));
+	    if (asize == bsize)
+		return bp;
+	    if (!best && asize < bsize)
+		best = bp;
+	}
+	return best;
+
+    default:
+	if (any_fits)
+	    return a->seg_roots[cls];
+	for (bp = a->seg_roots[cls]; bp != 0; bp = (char*)GET_NEXT_FREE(bp)) {
+	    if (asize <= GET_SIZE(HDRP(bp)))
+		return bp;
+	}
+	return NULL;
+    }
+}
+
+/* 
+ * Finds a fit for a new block. Only the request's own class can hold blocks that are
+ * too small, so that list is searched first. After that, the bitmap gives the first
+ * non-empty larger class, where every block fits and the policy only picks which one.
+ * If there are no free blocks large enough, returns NULL to show need for extending the heap.
+ */
+void *find_fit(arena_t *a, size_t asize)
+{
+    char *bp;
+    int cls = seg_class(asize);
+    unsigned int mask;
+
+    // search this class for a spot that is big enough, and use this.
+    if ((bp = search_class(a, cls, asize, 0)) != NULL)
+	return bp;
+
+    // fallthrough to the first non-empty class above this one.
+    mask = a->seg_bitmap & ~((2u << cls) - 1);
+    if(mask) {
+	return search_class(a, __builtin_ctz(mask), asize, 1);
     }
     return NULL; // no fit found
 }
 
 /*
- * Inserts a free block at the beginning of the appropriate free-list. If it is in
- * the small region, places at beginning of the small free-list, otherwise in the 
- * large free-list.
+ * Inserts a free block at the beginning of the free-list for its size class and marks
+ * that class as non-empty. Blocks in the tree class are handed to tree_insert.
 */
-static void insertFreeBlockAtBeginning(void* bp) {
+static void insertFreeBlockAtBeginning(arena_t *a, void* bp) {
 
-    // case 1
-    // (root)null -> (root)X, X.prev = 0, X.next = 0
-    if(IS_IN_SMALL_REGION(bp)) {
-      if(!free_list_small_root_p) {
-	free_list_small_root_p = bp;
-	SET_PREV_FREE(bp, 0);
-	SET_NEXT_FREE(bp, 0);
-      }
-
-      // case 2
-      // (root)Y -> (root)X, X <=> Y, X.prev = 0, 
-      else {
-	SET_PREV_FREE(bp, 0);
-	CREATE_2WAY_LINK(bp, free_list_small_root_p);
-	free_list_small_root_p = bp;
-      }
+    int cls = seg_class(GET_SIZE(HDRP(bp)));
 
-    } else {
+    // large blocks are indexed by the tree instead.
+    if(cls == SEG_TREE_CLASS) {
+	tree_insert(a, bp);
+	return;
+    }
 
-      if(!free_list_large_root_p) {
-	free_list_large_root_p = bp;
+    // case 1
+    // (root)null -> (root)X, X.prev = 0, X.next = 0
+    if(!a->seg_roots[cls]) {
+	a->seg_roots[cls] = bp;
 	SET_PREV_FREE(bp, 0);
 	SET_NEXT_FREE(bp, 0);
-      }
+	SEG_MARK(a, cls);
+    }
 
-      // case 2
-      // (root)Y -> (root)X, X <=> Y, X.prev = 0, 
-      else {
+    // case 2
+    // (root)Y -> (root)X, X <=> Y, X.prev = 0, 
+    else {
 	SET_PREV_FREE(bp, 0);
-	CREATE_2WAY_LINK(bp, free_list_large_root_p);
-	free_list_large_root_p = bp;
-      }
-
+	CREATE_2WAY_LINK(bp, a->seg_roots[cls]);
+	a->seg_roots[cls] = bp;
     }
 }
 
 /*
- * Removes a free block from the appropriate free-list, again using the region to
- * determine which free-list to remove from. Special cases included for if there is
- * no previous and/or next block.
+ * Removes a free block from the free-list of its size class. The block's size must not
+ * have changed since it was inserted. Special cases included for if there is no previous
+ * and/or next block.
 */
-static void dissociateBlockFromList(void* bp) {
+static void dissociateBlockFromList(arena_t *a, void* bp) {
+
+    int cls = seg_class(GET_SIZE(HDRP(bp)));
+
+    // large blocks live in the tree instead.
+    if(cls == SEG_TREE_CLASS) {
+	tree_remove(a, bp);
+	return;
+    }
 
     // get refs to the links surrounding this block.
     char* prevThing = (char*)GET_PREV_FREE(bp);
     char* nextThing = (char*)GET_NEXT_FREE(bp);
 
+    // a next-fit rover never points at a block that has left its list.
+    if(fit_policy == MM_FIT_NEXT && a->seg_rovers[cls] == bp) {
+	a->seg_rovers[cls] = nextThing;
+    }
+
     // Case 1
     //  (root)Y - Z -> (root)Z
     if(!prevThing && nextThing) {
 	SET_PREV_FREE(nextThing, 0);
-	if(IS_IN_SMALL_REGION(bp)) {
-	  free_list_small_root_p = nextThing;
-	} else {
-	  free_list_large_root_p = nextThing;
-	}
+	a->seg_roots[cls] = nextThing;
     }
 
     // case 2
@@ -614,76 +1807,233 @@ static void dissociateBlockFromList(void* bp) {
     // case 4
     // (root)Y -> (root is null)
     else {
-	if(IS_IN_SMALL_REGION(bp)) {
-	  free_list_small_root_p = 0;
-	} else {
-	  free_list_large_root_p = 0;
+	a->seg_roots[cls] = 0;
+	SEG_UNMARK(a, cls);
+    }
+}
+
+/*
+ * Top-down splay of the tree rooted at t around the key (size, key). Brings the node with
+ * that key to the root, or, if there is none, the node just before or just after where it
+ * would go. Links are heap offsets, so there is no dummy node on the stack to hang the left
+ * and right trees off; their roots are kept separately until the first node is linked.
+*/
+static char *tree_splay(char *t, size_t size, char *key) {
+
+    char *lroot = NULL, *rroot = NULL; // roots of the left and right trees
+    char *l = NULL, *r = NULL;         // largest node of the left tree, smallest of the right
+    char *y;
+
+    for(;;) {
+	if(TREE_LESS(size, key, GET_SIZE(HDRP(t)), t)) {
+	    if(!(y = GET_LEFT(t)))
+		break;
+
+	    // zig-zig: rotate right before linking.
+	    if(TREE_LESS(size, key, GET_SIZE(HDRP(y)), y)) {
+		SET_LEFT(t, GET_RIGHT(y));
+		SET_RIGHT(y, t);
+		t = y;
+		if(!GET_LEFT(t))
+		    break;
+	    }
+
+	    // link t into the right tree and keep going left.
+	    if(r)
+		SET_LEFT(r, t);
+	    else
+		rroot = t;
+	    r = t;
+	    t = GET_LEFT(t);
+	}
+	else if(TREE_LESS(GET_SIZE(HDRP(t)), t, size, key)) {
+	    if(!(y = GET_RIGHT(t)))
+		break;
+
+	    // zag-zag: rotate left before linking.
+	    if(TREE_LESS(GET_SIZE(HDRP(y)), y, size, key)) {
+		SET_RIGHT(t, GET_LEFT(y));
+		SET_LEFT(y, t);
+		t = y;
+		if(!GET_RIGHT(t))
+		    break;
+	    }
+
+	    // link t into the left tree and keep going right.
+	    if(l)
+		SET_RIGHT(l, t);
+	    else
+		lroot = t;
+	    l = t;
+	    t = GET_RIGHT(t);
+	}
+	else {
+	    break;
 	}
     }
+
+    // reassemble the left, middle and right trees under t.
+    if(l)
+	SET_RIGHT(l, GET_LEFT(t));
+    else
+	lroot = GET_LEFT(t);
+    if(r)
+	SET_LEFT(r, GET_RIGHT(t));
+    else
+	rroot = GET_RIGHT(t);
+    SET_LEFT(t, lroot);
+    SET_RIGHT(t, rroot);
+    return t;
 }
 
+/*
+ * Inserts a free block into the tree. The tree is splayed around the new block's key
+ * and the old root becomes one of its children.
+*/
+static void tree_insert(arena_t *a, void* bp) {
+
+    char *t = a->seg_roots[SEG_TREE_CLASS];
+    size_t size = GET_SIZE(HDRP(bp));
+
+    // case 1
+    // empty tree -> bp is the only node
+    if(!t) {
+	SET_LEFT(bp, 0);
+	SET_RIGHT(bp, 0);
+	a->seg_roots[SEG_TREE_CLASS] = bp;
+	SEG_MARK(a, SEG_TREE_CLASS);
+	return;
+    }
+
+    t = tree_splay(t, size, bp);
+
+    // case 2
+    // bp goes in front of the splayed root
+    if(TREE_LESS(size, bp, GET_SIZE(HDRP(t)), t)) {
+	SET_LEFT(bp, GET_LEFT(t));
+	SET_RIGHT(bp, t);
+	SET_LEFT(t, 0);
+    }
+
+    // case 3
+    // bp goes after the splayed root
+    else {
+	SET_RIGHT(bp, GET_RIGHT(t));
+	SET_LEFT(bp, t);
+	SET_RIGHT(t, 0);
+    }
+
+    a->seg_roots[SEG_TREE_CLASS] = bp;
+}
+
+/*
+ * Removes a free block from the tree. Splaying on its key brings it to the root; its left
+ * subtree is then splayed on the same key, which leaves that subtree's largest node on top
+ * with no right child, ready to take over the right subtree.
+*/
+static void tree_remove(arena_t *a, void* bp) {
+
+    size_t size = GET_SIZE(HDRP(bp));
+    char *t = tree_splay(a->seg_roots[SEG_TREE_CLASS], size, bp);
+    char *root;
+
+    if(!GET_LEFT(t)) {
+	root = GET_RIGHT(t);
+    }
+    else {
+	root = tree_splay(GET_LEFT(t), size, bp);
+	SET_RIGHT(root, GET_RIGHT(t));
+    }
+
+    a->seg_roots[SEG_TREE_CLASS] = root;
+    if(!root)
+	SEG_UNMARK(a, SEG_TREE_CLASS);
+}
+
+/*
+ * Finds the smallest free block in the tree that is at least asize bytes. This is a plain
+ * search with no splay: the block found is about to be removed, and tree_remove splays it
+ * to the root anyway.
+*/
+static void *tree_find_fit(arena_t *a, size_t asize) {
+
+    char *t = a->seg_roots[SEG_TREE_CLASS];
+    char *best = NULL;
+
+    // every block that fits is a candidate; the search continues left for a tighter one.
+    while(t) {
+	if(asize <= GET_SIZE(HDRP(t))) {
+	    best = t;
+	    t = GET_LEFT(t);
+	}
+	else {
+	    t = GET_RIGHT(t);
+	}
+    }
+    return best;
+}
 
 /*
  * Attempts to combine a newly freed block with surrounding free blocks. Four
  * cases based on whether the previous and next blocks are allocated or free.
  * Includes modifying boundary tags based on size and which blocks were combined.
+ * The previous block's state comes from the prev-alloc bit, since only a free
+ * previous block has a footer to read. The merged block keeps the prev-alloc bit
+ * of whichever header ends up in front.
  */
-static void *coalesce(void *bp) 
+static void *coalesce(arena_t *a, void *bp) 
 {
 
     // information about the surrounding blocks.
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     size_t size = GET_SIZE(HDRP(bp));
 
-    if(!hasFinishedInit) { // Case 0 
-	return bp;
-    }
-    else if (prev_alloc && next_alloc) {            /* Case 1 */
-	insertFreeBlockAtBeginning(bp);
+    if (prev_alloc && next_alloc) {            /* Case 1 */
+	insertFreeBlockAtBeginning(a, bp);
     }
     else if (prev_alloc && !next_alloc) {      /* Case 2 */
 
 	// break links off of the next thing
-	dissociateBlockFromList(NEXT_BLKP(bp));
-
-	// insert this block into a freelist.
-	insertFreeBlockAtBeginning(bp);
+	dissociateBlockFromList(a, NEXT_BLKP(bp));
 
 	// expand the size of the block.
 	size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-	PUT(HDRP(bp), PACK(size, 0));
+	PUT_KEEP_PREV(HDRP(bp), PACK(size, 0));
 	PUT(FTRP(bp), PACK(size,0));
+
+	// insert this block into the freelist for its new size.
+	insertFreeBlockAtBeginning(a, bp);
     }
     else if (!prev_alloc && next_alloc) {      /* Case 3 */
 
 	// break links off of the next thing
-	dissociateBlockFromList(PREV_BLKP(bp));
+	dissociateBlockFromList(a, PREV_BLKP(bp));
 
 	// expand this block and move the starting index.
 	size += GET_SIZE(HDRP(PREV_BLKP(bp)));
 	PUT(FTRP(bp), PACK(size, 0));
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+	PUT_KEEP_PREV(HDRP(PREV_BLKP(bp)), PACK(size, 0));
 	bp = PREV_BLKP(bp);
 
 	// insert into a freelist.
-	insertFreeBlockAtBeginning(bp);
+	insertFreeBlockAtBeginning(a, bp);
     }
     else {                                     /* Case 4 */
 
 	// break BOTH side's links.
-	dissociateBlockFromList(PREV_BLKP(bp));
-	dissociateBlockFromList(NEXT_BLKP(bp));
+	dissociateBlockFromList(a, PREV_BLKP(bp));
+	dissociateBlockFromList(a, NEXT_BLKP(bp));
 
 	// expand the block and move the starting index.
 	size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
 	    GET_SIZE(FTRP(NEXT_BLKP(bp)));
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+	PUT_KEEP_PREV(HDRP(PREV_BLKP(bp)), PACK(size, 0));
 	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
 	bp = PREV_BLKP(bp);
 
 	// insert into freelist.
-	insertFreeBlockAtBeginning(bp);
+	insertFreeBlockAtBeginning(a, bp);
     }
 
     return bp;
@@ -694,11 +2044,14 @@ static void *coalesce(void *bp)
 */
 static void condPrintblockExtra(void *bp) 
 {
-    size_t hsize, halloc, fsize, falloc, next, prev;
+    size_t hsize, halloc, hprev, fsize, falloc;
+    char *next, *prev;
 
-    // a bunch of facts about this block.
+    // a bunch of facts about this block. allocated blocks have no footer, so
+    // the last word of their payload shows up in its place.
     hsize = GET_SIZE(HDRP(bp));
     halloc = GET_ALLOC(HDRP(bp));  
+    hprev = GET_PREV_ALLOC(HDRP(bp));
     fsize = GET_SIZE(FTRP(bp));
     falloc = GET_ALLOC(FTRP(bp));  
     next = GET_NEXT_FREE(bp);
@@ -711,25 +2064,53 @@ static void condPrintblockExtra(void *bp)
     }
 
     // print all the facts.
-    printf("\t\t> bp: %p, *bp: %x, header: [%d:%c] footer: [%d:%c] next:%x prev: %x\n",
+    printf("\t\t> bp: %p, *bp: %x, header: [%zu:%c:%c] footer: [%zu:%c] next:%p prev: %p\n",
  	   bp, 
- 	   *(size_t*)bp,
- 	   hsize, (halloc ? 'a' : 'f'), 
+ 	   GET(bp),
+ 	   hsize, (halloc ? 'a' : 'f'), (hprev ? 'a' : 'f'), 
  	   fsize, (falloc ? 'a' : 'f'),
  	   next, prev); 
 }
 
 /*
- * Checks if given block is DWORD-aligned and if header and footer match.
- * Used for debugging.
+ * Walks the tree in order, checking every node as a block, checking that it belongs
+ * in the tree class, and checking that its children are on the correct sides.
+ * Returns the number of nodes. Used for debugging.
+*/
+static int checktree(char *t, int verbose)
+{
+    char *left, *right;
+
+    if (!t)
+	return 0;
+
+    left = GET_LEFT(t);
+    right = GET_RIGHT(t);
+    if (left && !TREE_LESS(GET_SIZE(HDRP(left)), left, GET_SIZE(HDRP(t)), t))
+	printf("Error: tree node %p has a left child %p that is not smaller\n", t, left);
+    if (right && !TREE_LESS(GET_SIZE(HDRP(t)), t, GET_SIZE(HDRP(right)), right))
+	printf("Error: tree node %p has a right child %p that is not larger\n", t, right);
+
+    int count = checktree(left, verbose);
+    if (verbose)
+	condPrintblockExtra(t);
+    checkblock(t);
+    if (seg_class(GET_SIZE(HDRP(t))) != SEG_TREE_CLASS)
+	printf("Error: %p is in the tree but belongs in class %d\n", t, seg_class(GET_SIZE(HDRP(t))));
+    return count + 1 + checktree(right, verbose);
+}
+
+/*
+ * Checks if given block is ALIGNMENT-aligned and, for a free block, if header and footer
+ * match. Allocated blocks have no footer to compare. Used for debugging.
 */
 void checkblock(void *bp) 
 {
-    if ((size_t)bp % 8) {
-	printf("Error: %p is not doubleword aligned\n", bp);
+    if ((uintptr_t)bp % ALIGNMENT) {
+	printf("Error: %p is not %d-byte aligned\n", bp, ALIGNMENT);
 	exit(1);
     }
-    if (GET(HDRP(bp)) != GET(FTRP(bp))) {
+    if (!GET_ALLOC(HDRP(bp)) && (GET(HDRP(bp)) & ~PREV_ALLOC) != GET(FTRP(bp))) {
 	printf("Error: header does not match footer\n");
 	exit(1);
     }
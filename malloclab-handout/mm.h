@@ -5,6 +5,20 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/* Placement policies for mm_set_fit_policy() */
+#define MM_FIT_FIRST 0  /* first block that fits */
+#define MM_FIT_NEXT  1  /* first fit, resuming where the last search stopped */
+#define MM_FIT_BEST  2  /* smallest of the first N blocks that fit */
+#define MM_FIT_EXACT 3  /* exact size if there is one, else first fit */
+
+extern void mm_set_fit_policy(int policy, int max_candidates);
+extern void mm_set_thread_safe(int enable);
+extern void mm_set_arenas(int n);
+extern void mm_set_mmap_threshold(size_t threshold);
+extern void mm_set_realloc_headroom(size_t cap);
+extern int mm_trim(size_t pad);
+extern size_t mm_remote_frees(void);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
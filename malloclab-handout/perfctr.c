@@ -0,0 +1,168 @@
+/*
+ * perfctr.c - Count the hardware events caused by a function f
+ *
+ * Uses the Linux perf_event_open interface, which needs no special
+ * hardware or privileges: the events are counted in user mode for the
+ * calling thread only. The events are opened as one group so that
+ * they are all counted over exactly the same instructions. If the PMU
+ * has too few counters to hold the whole group, each event is counted
+ * on its own instead and the kernel multiplexes them, and the counts
+ * are scaled up by the share of the run each one was scheduled for.
+ * Events the CPU or the kernel does not offer are left out.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "perfctr.h"
+
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+/* The perf type and config of each event, in PERFCTR_xxx order */
+static struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERFCTR_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+				     PERF_COUNT_HW_CACHE_OP_READ,
+				     PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+				     PERF_COUNT_HW_CACHE_OP_READ,
+				     PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/* What read() returns for a group leader (or an event on its own) */
+typedef struct {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERFCTR_EVENTS];
+} group_read_t;
+
+/*
+ * open_event - Open event i, disabled, in the group led by group_fd
+ *     (or as a leader if group_fd is -1). Return its fd or -1.
+ */
+static int open_event(int i, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.disabled = (group_fd == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+    if (group_fd == -1)
+	attr.read_format |= PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/*
+ * count_group - Count the events in one group over a run of f(argp).
+ *     Return how many were counted: 0 if the group was never scheduled,
+ *     or -1 if no event could be opened at all.
+ */
+static int count_group(perfctr_test_funct f, void *argp, double *counts)
+{
+    int fds[PERFCTR_EVENTS], members[PERFCTR_EVENTS];
+    int i, n = 0, leader = -1;
+    group_read_t r;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+	if ((fds[i] = open_event(i, leader)) < 0)
+	    continue;
+	if (leader == -1)
+	    leader = fds[i];
+	members[n++] = i;
+    }
+    if (leader == -1)
+	return -1;
+
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    f(argp);
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    if (read(leader, &r, sizeof(r)) < 0 || r.time_running == 0)
+	n = 0;
+    for (i = 0; i < n; i++)
+	counts[members[i]] = r.values[i];
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	if (fds[i] >= 0)
+	    close(fds[i]);
+    return n;
+}
+
+/*
+ * count_apart - Count each event on its own over a run of f(argp),
+ *     scaling up the counts of events that were multiplexed
+ */
+static int count_apart(perfctr_test_funct f, void *argp, double *counts)
+{
+    int fds[PERFCTR_EVENTS];
+    int i, n = 0;
+    group_read_t r;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	fds[i] = open_event(i, -1);
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    f(argp);
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < PERFCTR_EVENTS; i++) {
+	if (fds[i] < 0)
+	    continue;
+	if (read(fds[i], &r, sizeof(r)) > 0 && r.time_running > 0) {
+	    counts[i] = (double)r.values[0] * r.time_enabled / r.time_running;
+	    n++;
+	}
+	close(fds[i]);
+    }
+    return n;
+}
+
+/*
+ * perfctr_count - Count the events caused by one run of f(argp)
+ */
+int perfctr_count(perfctr_test_funct f, void *argp, double *counts)
+{
+    int i, n;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	counts[i] = -1;
+    if ((n = count_group(f, argp, counts)) != 0)
+	return n < 0 ? 0 : n;
+    return count_apart(f, argp, counts);
+}
+
+#else
+
+/* There is nothing to count events with off Linux */
+int perfctr_count(perfctr_test_funct f, void *argp, double *counts)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_EVENTS; i++)
+	counts[i] = -1;
+    return 0;
+}
+
+#endif
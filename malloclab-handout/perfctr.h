@@ -0,0 +1,20 @@
+/*
+ * perfctr.h - prototypes for the routines in perfctr.c that count the
+ *     hardware events (cycles, cache misses, ...) caused by a test
+ *     function f
+ */
+
+/* The events counted, in the order perfctr_count reports them */
+#define PERFCTR_CYCLES       0
+#define PERFCTR_INSTRUCTIONS 1
+#define PERFCTR_L1D_MISSES   2
+#define PERFCTR_LLC_MISSES   3
+#define PERFCTR_DTLB_MISSES  4
+#define PERFCTR_BRANCH_MISSES 5
+#define PERFCTR_EVENTS       6
+
+typedef void (*perfctr_test_funct)(void *);
+
+/* Count the events caused by one run of f(argp) into counts[], with -1
+   for each event that could not be counted. Return how many were. */
+int perfctr_count(perfctr_test_funct f, void *argp, double *counts);